@@ -0,0 +1,241 @@
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include "cache.h"
+
+BlockCache::BlockCache(Disk &disk, unsigned capacity) : disk(disk)
+{
+    this->capacity = capacity > 0 ? capacity : 1;
+}
+
+BlockCache::~BlockCache()
+{
+    sync();
+}
+
+BlockCache::cache_block *
+BlockCache::lookup(unsigned block_no)
+{
+    auto it = index.find(block_no);
+    if (it == index.end()) {
+        misses++;
+        return nullptr;
+    }
+    hits++;
+    // move it to the front, it is now the most recently used
+    lru.splice(lru.begin(), lru, it->second);
+    return &lru.front();
+}
+
+BlockCache::cache_block *
+BlockCache::insert(unsigned block_no)
+{
+    while (lru.size() >= capacity) {
+        if (evict() == -1)
+            return nullptr;
+    }
+    lru.push_front(cache_block());
+    cache_block &cb = lru.front();
+    cb.block_no = block_no;
+    cb.dirty = false;
+    cb.data.resize(disk.get_block_size());
+    index[block_no] = lru.begin();
+    return &cb;
+}
+
+int
+BlockCache::evict()
+{
+    if (lru.empty())
+        return 0;
+    // a dirty victim means there is write-back to do anyway, so take
+    // every dirty block along and write them all in one go
+    if (lru.back().dirty && sync() == -1)
+        return -1;
+    if (DEBUG)
+        std::cout << "BlockCache::evict(" << lru.back().block_no << ")\n";
+    index.erase(lru.back().block_no);
+    lru.pop_back();
+    return 0;
+}
+
+BlockCache::cache_block *
+BlockCache::load(unsigned block_no)
+{
+    cache_block *cb = lookup(block_no);
+    if (cb == nullptr) {
+        if (block_no >= disk.get_no_blocks()) {
+            std::cout << "BlockCache::read - ERROR: Invalid block number (" << block_no << ")\n";
+            return nullptr;
+        }
+        cb = insert(block_no);
+        if (cb == nullptr || disk.read(block_no, cb->data.data()) == -1) {
+            // don't leave a block with garbage in the cache
+            if (cb != nullptr) {
+                index.erase(block_no);
+                lru.pop_front();
+            }
+            return nullptr;
+        }
+    }
+    return cb;
+}
+
+// reads one block, from the cache if possible
+int
+BlockCache::read(unsigned block_no, uint8_t *blk)
+{
+    cache_block *cb = load(block_no);
+    if (cb == nullptr)
+        return -1;
+    memcpy(blk, cb->data.data(), disk.get_block_size());
+    return 0;
+}
+
+// the cached copy of a block, looked at without copying it out
+const uint8_t *
+BlockCache::view(unsigned block_no)
+{
+    cache_block *cb = load(block_no);
+    return cb != nullptr ? cb->data.data() : nullptr;
+}
+
+// the cached copy of a block, to be changed in place
+uint8_t *
+BlockCache::modify(unsigned block_no)
+{
+    cache_block *cb = load(block_no);
+    if (cb == nullptr)
+        return nullptr;
+    if (!cb->dirty) {
+        cb->dirty = true;
+        no_dirty++;
+    }
+    return cb->data.data();
+}
+
+// writes one block into the cache and marks it dirty
+int
+BlockCache::write(unsigned block_no, uint8_t *blk)
+{
+    if (block_no >= disk.get_no_blocks()) {
+        std::cout << "BlockCache::write - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    cache_block *cb = lookup(block_no);
+    if (cb == nullptr) {
+        cb = insert(block_no);
+        if (cb == nullptr)
+            return -1;
+    }
+    memcpy(cb->data.data(), blk, disk.get_block_size());
+    if (!cb->dirty) {
+        cb->dirty = true;
+        no_dirty++;
+    }
+    return 0;
+}
+
+int
+BlockCache::read_blocks(const std::vector<unsigned> &block_nos, const std::vector<uint8_t*> &blks)
+{
+    if (block_nos.size() != blks.size()) {
+        std::cout << "BlockCache::read_blocks - ERROR: " << block_nos.size() << " blocks but "
+                  << blks.size() << " buffers\n";
+        return -1;
+    }
+    // serve what we can from the cache and collect the rest
+    std::vector<unsigned> miss_nos;
+    std::vector<uint8_t*> miss_blks;
+    for (unsigned i = 0; i < block_nos.size(); i++) {
+        cache_block *cb = lookup(block_nos[i]);
+        if (cb != nullptr) {
+            memcpy(blks[i], cb->data.data(), disk.get_block_size());
+        } else {
+            miss_nos.push_back(block_nos[i]);
+            miss_blks.push_back(blks[i]);
+        }
+    }
+    if (miss_nos.empty())
+        return 0;
+    // a dirty block can only be in the cache, so the misses are safe to
+    // read straight from the disk into the callers buffers
+    if (disk.read_blocks(miss_nos, miss_blks) == -1)
+        return -1;
+    for (unsigned i = 0; i < miss_nos.size(); i++) {
+        if (index.count(miss_nos[i]))
+            continue;
+        cache_block *cb = insert(miss_nos[i]);
+        if (cb == nullptr)
+            return -1;
+        memcpy(cb->data.data(), miss_blks[i], disk.get_block_size());
+    }
+    return 0;
+}
+
+int
+BlockCache::write_blocks(const std::vector<unsigned> &block_nos, const std::vector<uint8_t*> &blks)
+{
+    if (block_nos.size() != blks.size()) {
+        std::cout << "BlockCache::write_blocks - ERROR: " << block_nos.size() << " blocks but "
+                  << blks.size() << " buffers\n";
+        return -1;
+    }
+    for (unsigned i = 0; i < block_nos.size(); i++) {
+        if (write(block_nos[i], blks[i]) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// writes every dirty block back to the disk, in block order
+int
+BlockCache::sync()
+{
+    if (no_dirty == 0)
+        return 0;
+    std::vector<cache_block*> dirty;
+    for (auto it = lru.begin(); it != lru.end(); it++) {
+        if (it->dirty)
+            dirty.push_back(&*it);
+    }
+    // sorted by block number so runs of blocks go out in one pwritev
+    std::sort(dirty.begin(), dirty.end(),
+              [](const cache_block *a, const cache_block *b) { return a->block_no < b->block_no; });
+    std::vector<unsigned> block_nos;
+    std::vector<uint8_t*> blks;
+    for (unsigned i = 0; i < dirty.size(); i++) {
+        block_nos.push_back(dirty[i]->block_no);
+        blks.push_back(dirty[i]->data.data());
+    }
+    if (disk.write_blocks(block_nos, blks) == -1)
+        return -1;
+    for (unsigned i = 0; i < dirty.size(); i++)
+        dirty[i]->dirty = false;
+    no_dirty = 0;
+    return 0;
+}
+
+// changes how many blocks the cache holds, evicting if needed
+int
+BlockCache::set_capacity(unsigned new_capacity)
+{
+    capacity = new_capacity > 0 ? new_capacity : 1;
+    while (lru.size() > capacity) {
+        if (evict() == -1)
+            return -1;
+    }
+    return 0;
+}
+
+// writes back and then forgets every cached block, has to be done
+// before the disk geometry changes under the cache
+int
+BlockCache::invalidate()
+{
+    if (sync() == -1)
+        return -1;
+    lru.clear();
+    index.clear();
+    return 0;
+}
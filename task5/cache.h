@@ -0,0 +1,70 @@
+#include <iostream>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "disk.h"
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// default number of blocks kept in the cache
+#define CACHE_BLOCKS 64
+
+// write-back block cache sitting between the FS and the Disk.
+// blocks are evicted in LRU order, a write only marks the cached copy
+// dirty and it is written to the disk on sync() or when it is evicted.
+class BlockCache {
+private:
+    struct cache_block {
+        unsigned block_no;
+        bool dirty;
+        std::vector<uint8_t> data;
+    };
+    Disk &disk;
+    unsigned capacity;
+    // most recently used block first
+    std::list<cache_block> lru;
+    std::unordered_map<unsigned, std::list<cache_block>::iterator> index;
+    unsigned no_dirty = 0;
+    unsigned hits = 0;
+    unsigned misses = 0;
+    // returns the cached block and marks it as most recently used,
+    // nullptr if it is not in the cache
+    cache_block *lookup(unsigned block_no);
+    // makes room for and adds a block, its data is left uninitialized
+    cache_block *insert(unsigned block_no);
+    // drops the least recently used block, writing back first if dirty
+    int evict();
+    // the cached block, read in from the disk if it isn't cached
+    cache_block *load(unsigned block_no);
+public:
+    BlockCache(Disk &disk, unsigned capacity = CACHE_BLOCKS);
+    ~BlockCache();
+    // reads one block, from the cache if possible
+    int read(unsigned block_no, uint8_t *blk);
+    // writes one block into the cache and marks it dirty
+    int write(unsigned block_no, uint8_t *blk);
+    // a pointer straight to the cached copy of a block, read in first if
+    // it isn't cached. only good until the next call into the cache,
+    // nullptr on error
+    const uint8_t *view(unsigned block_no);
+    // same as view, but the block is marked dirty so it can be changed in place
+    uint8_t *modify(unsigned block_no);
+    // same as read/write but for many blocks, the ones that miss the
+    // cache are read with a single vectored disk read
+    int read_blocks(const std::vector<unsigned> &block_nos, const std::vector<uint8_t*> &blks);
+    int write_blocks(const std::vector<unsigned> &block_nos, const std::vector<uint8_t*> &blks);
+    // writes every dirty block back to the disk, in block order
+    int sync();
+    // writes back and then forgets every cached block, has to be done
+    // before the disk geometry changes under the cache
+    int invalidate();
+    // changes how many blocks the cache holds, evicting if needed
+    int set_capacity(unsigned new_capacity);
+    unsigned get_capacity() { return capacity; }
+    unsigned get_hits() { return hits; }
+    unsigned get_misses() { return misses; }
+};
+
+#endif // __CACHE_H__
@@ -1,33 +1,108 @@
 #include <iostream>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "disk.h"
 
-Disk::Disk()
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+Disk::Disk(bool use_mmap)
 {
+    this->use_mmap = use_mmap;
     // first check if the disk file exists, otherwise create it.
-    if (!disk_file_exists(DISKNAME)) {
+    bool exists = disk_file_exists(DISKNAME);
+    if (!exists) {
         std::cout << "No disk file found...\n";
         std::cout << "Creating disk file: " << DISKNAME << std::endl;
-        std::ofstream f(DISKNAME, std::ios::binary | std::ios::out);
-        f.seekp((1<<23)-1);
-        f.write("", 1);
     }
     // the disk is simulated as a binary file
-    diskfile.open(DISKNAME, std::ios::in | std::ios::out | std::ios::binary);
-    if (!diskfile.is_open()) {
+    fd = open(DISKNAME, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
         std::cerr << "ERROR: Can't open diskfile: " << DISKNAME << ", exiting..."<< std::endl;
         exit(-1);
     }
+    // an existing file is looked at in default sized blocks until the
+    // file system has read its superblock and calls set_geometry
+    struct stat st;
+    if (exists && fstat(fd, &st) == 0 && st.st_size >= BLOCK_SIZE) {
+        no_blocks = st.st_size / BLOCK_SIZE;
+        disk_size = (size_t)no_blocks * BLOCK_SIZE;
+    } else if (ftruncate(fd, disk_size) == -1) {
+        std::cerr << "ERROR: Can't resize diskfile: " << DISKNAME << ", exiting..."<< std::endl;
+        exit(-1);
+    }
+    map_disk();
 }
 
 Disk::~Disk()
 {
-    diskfile.close();
+    unmap_disk();
+    if (fd != -1)
+        close(fd);
+}
+
+void
+Disk::map_disk()
+{
+    if (!use_mmap)
+        return;
+    void *addr = mmap(nullptr, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        std::cerr << "WARNING: Can't mmap diskfile, falling back to pread/pwrite" << std::endl;
+        map = nullptr;
+    } else {
+        map = (uint8_t*)addr;
+    }
+}
+
+void
+Disk::unmap_disk()
+{
+    if (map != nullptr)
+        munmap(map, disk_size);
+    map = nullptr;
+}
+
+// changes the block size and number of blocks, resizing the disk
+// file to match
+int
+Disk::set_geometry(unsigned new_block_size, unsigned new_no_blocks)
+{
+    if (new_block_size < MIN_BLOCK_SIZE || new_block_size > MAX_BLOCK_SIZE ||
+        (new_block_size & (new_block_size - 1)) != 0) {
+        std::cout << "Disk::set_geometry - ERROR: Invalid block size (" << new_block_size << ")\n";
+        return -1;
+    }
+    if (new_no_blocks == 0) {
+        std::cout << "Disk::set_geometry - ERROR: Invalid number of blocks (" << new_no_blocks << ")\n";
+        return -1;
+    }
+    size_t new_size = (size_t)new_block_size * new_no_blocks;
+    unmap_disk();
+    if (new_size != disk_size && ftruncate(fd, new_size) == -1) {
+        std::cout << "Disk::set_geometry - ERROR: " << strerror(errno) << "\n";
+        map_disk();
+        return -1;
+    }
+    block_size = new_block_size;
+    no_blocks = new_no_blocks;
+    disk_size = new_size;
+    map_disk();
+    return 0;
 }
 
 bool
 Disk::disk_file_exists (const std::string& name) {
-    std::ifstream f(name.c_str());
-    return f.good();
+    struct stat st;
+    return stat(name.c_str(), &st) == 0;
 }
 
 // writes one block to the disk
@@ -41,10 +116,23 @@ Disk::write(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekp(offset, std::ios_base::beg);
-    diskfile.write((char*)blk, BLOCK_SIZE);
-    diskfile.flush();
+    off_t offset = (off_t)block_no * block_size;
+    if (map != nullptr) {
+        memcpy(map + offset, blk, block_size);
+        return 0;
+    }
+    size_t done = 0;
+    // pwrite may write less than asked for, keep going until the block is out
+    while (done < block_size) {
+        ssize_t n = pwrite(fd, blk + done, block_size - done, offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            std::cout << "Disk::write - ERROR: " << strerror(errno) << " (" << block_no << ")\n";
+            return -1;
+        }
+        done += n;
+    }
     return 0;
 }
 
@@ -56,11 +144,141 @@ Disk::read(unsigned block_no, uint8_t *blk)
         std::cout << "Disk::read(" << block_no << ")\n";
     // check if valid block number
     if (block_no >= no_blocks) {
-        std::cout << "Disk::write - ERROR: Invalid block number (" << block_no << ")\n";
+        std::cout << "Disk::read - ERROR: Invalid block number (" << block_no << ")\n";
+        return -1;
+    }
+    off_t offset = (off_t)block_no * block_size;
+    if (map != nullptr) {
+        memcpy(blk, map + offset, block_size);
+        return 0;
+    }
+    size_t done = 0;
+    while (done < block_size) {
+        ssize_t n = pread(fd, blk + done, block_size - done, offset + done);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            std::cout << "Disk::read - ERROR: " << strerror(errno) << " (" << block_no << ")\n";
+            return -1;
+        }
+        // reading past the end of a short file gives zeroes, like the old stream did
+        if (n == 0) {
+            memset(blk + done, 0, block_size - done);
+            break;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// writes blks[i] to block block_nos[i], runs of contiguous block numbers
+// are merged and written with a single pwritev
+int
+Disk::write_blocks(const std::vector<unsigned> &block_nos, const std::vector<uint8_t*> &blks)
+{
+    return transfer_blocks(block_nos, blks, true);
+}
+
+// reads block block_nos[i] into blks[i], runs of contiguous block numbers
+// are merged and read with a single preadv
+int
+Disk::read_blocks(const std::vector<unsigned> &block_nos, const std::vector<uint8_t*> &blks)
+{
+    return transfer_blocks(block_nos, blks, false);
+}
+
+int
+Disk::transfer_blocks(const std::vector<unsigned> &block_nos,
+                      const std::vector<uint8_t*> &blks, bool writing)
+{
+    const char *name = writing ? "Disk::write_blocks" : "Disk::read_blocks";
+    if (block_nos.size() != blks.size()) {
+        std::cout << name << " - ERROR: " << block_nos.size() << " blocks but "
+                  << blks.size() << " buffers\n";
+        return -1;
+    }
+    for (unsigned i = 0; i < block_nos.size(); i++) {
+        if (block_nos[i] >= no_blocks) {
+            std::cout << name << " - ERROR: Invalid block number (" << block_nos[i] << ")\n";
+            return -1;
+        }
+    }
+    if (map != nullptr) {
+        for (unsigned i = 0; i < block_nos.size(); i++) {
+            uint8_t *mapped = map + (size_t)block_nos[i] * block_size;
+            if (writing)
+                memcpy(mapped, blks[i], block_size);
+            else
+                memcpy(blks[i], mapped, block_size);
+        }
+        return 0;
+    }
+
+    std::vector<struct iovec> iov;
+    unsigned i = 0;
+    while (i < block_nos.size()) {
+        // find how far the run of contiguous block numbers starting at i goes
+        unsigned run = 1;
+        while (i + run < block_nos.size() && run < IOV_MAX &&
+               block_nos[i + run] == block_nos[i] + run)
+            run++;
+        if (DEBUG)
+            std::cout << name << "(" << block_nos[i] << ", " << run << ")\n";
+
+        iov.resize(run);
+        for (unsigned j = 0; j < run; j++) {
+            iov[j].iov_base = blks[i + j];
+            iov[j].iov_len = block_size;
+        }
+        struct iovec *cur = iov.data();
+        int cnt = run;
+        off_t offset = (off_t)block_nos[i] * block_size;
+        // the kernel may transfer less than asked for, move the iovecs
+        // forward past what was done and go again
+        while (cnt > 0) {
+            ssize_t n = writing ? pwritev(fd, cur, cnt, offset) : preadv(fd, cur, cnt, offset);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == -1 || (n == 0 && writing)) {
+                std::cout << name << " - ERROR: " << strerror(errno) << " (" << block_nos[i] << ")\n";
+                return -1;
+            }
+            // reading past the end of a short file gives zeroes
+            if (n == 0) {
+                for (int j = 0; j < cnt; j++)
+                    memset(cur[j].iov_base, 0, cur[j].iov_len);
+                break;
+            }
+            offset += n;
+            while (cnt > 0 && (size_t)n >= cur->iov_len) {
+                n -= cur->iov_len;
+                cur++;
+                cnt--;
+            }
+            if (cnt > 0) {
+                cur->iov_base = (uint8_t*)cur->iov_base + n;
+                cur->iov_len -= n;
+            }
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// makes sure everything written so far has reached the disk file
+int
+Disk::sync()
+{
+    if (map != nullptr) {
+        if (msync(map, disk_size, MS_SYNC) == -1) {
+            std::cout << "Disk::sync - ERROR: " << strerror(errno) << "\n";
+            return -1;
+        }
+        return 0;
+    }
+    if (fdatasync(fd) == -1) {
+        std::cout << "Disk::sync - ERROR: " << strerror(errno) << "\n";
         return -1;
     }
-    unsigned offset = block_no * BLOCK_SIZE;
-    diskfile.seekg(offset, std::ios_base::beg);
-    diskfile.read((char*)blk, BLOCK_SIZE);
     return 0;
 }
@@ -1,28 +1,65 @@
 #include <iostream>
-#include <fstream>
+#include <cstdint>
+#include <vector>
 
 #ifndef __DISK_H__
 #define __DISK_H__
 
 #define DISKNAME "diskfile.bin"
+// geometry used for a new disk file, or until the file system has told
+// the disk what its superblock says
 #define BLOCK_SIZE 4096
+#define NO_BLOCKS 2048
+// smallest and largest block size a disk can be set up with
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
 #define DEBUG false
+// serve block I/O from a shared memory mapping of the disk file instead of
+// pread/pwrite, build with "make DEFS=-DDISK_MMAP=true" to turn it on
+#ifndef DISK_MMAP
+#define DISK_MMAP false
+#endif
 
 class Disk {
 private:
-    std::fstream diskfile;
-    const unsigned no_blocks = 2048;
-    const unsigned disk_size = BLOCK_SIZE * no_blocks;
+    // the disk file is accessed through a raw file descriptor with
+    // positional pread/pwrite, so there is no shared seek position
+    int fd = -1;
+    // start of the mapping when running in mmap mode, nullptr otherwise
+    uint8_t *map = nullptr;
+    bool use_mmap;
+    unsigned block_size = BLOCK_SIZE;
+    unsigned no_blocks = NO_BLOCKS;
+    size_t disk_size = (size_t)BLOCK_SIZE * NO_BLOCKS;
     bool disk_file_exists (const std::string& name);
+    // maps the whole disk file when running in mmap mode
+    void map_disk();
+    void unmap_disk();
+    // shared body of read_blocks/write_blocks
+    int transfer_blocks(const std::vector<unsigned> &block_nos,
+                        const std::vector<uint8_t*> &blks, bool writing);
 public:
-    Disk();
+    Disk(bool use_mmap = DISK_MMAP);
     ~Disk();
+    unsigned get_block_size() { return block_size; }
     unsigned get_no_blocks() { return no_blocks; }
-    unsigned get_disk_size() { return disk_size; }
+    size_t get_disk_size() { return disk_size; }
+    // changes the block size and number of blocks, resizing the disk
+    // file to match. block_size must be a power of two between
+    // MIN_BLOCK_SIZE and MAX_BLOCK_SIZE
+    int set_geometry(unsigned new_block_size, unsigned new_no_blocks);
     // writes one block to the disk
     int write(unsigned block_no, uint8_t *blk);
     // reads one block from the disk
     int read(unsigned block_no, uint8_t *blk);
+    // writes blks[i] to block block_nos[i], runs of contiguous block numbers
+    // are merged and written with a single pwritev
+    int write_blocks(const std::vector<unsigned> &block_nos, const std::vector<uint8_t*> &blks);
+    // reads block block_nos[i] into blks[i], runs of contiguous block numbers
+    // are merged and read with a single preadv
+    int read_blocks(const std::vector<unsigned> &block_nos, const std::vector<uint8_t*> &blks);
+    // makes sure everything written so far has reached the disk file
+    int sync();
 };
 
 #endif // __DISK_H__
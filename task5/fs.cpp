@@ -1,47 +1,57 @@
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <stack>
+#include <unistd.h>
 #include "fs.h"
 
-FS::FS()
+FS::FS() : cache(disk)
 {
     std::cout << "FS::FS()... Creating file system\n";
-    readInFatRoot();
+    if (readSuperBlock() == -1)
+    {
+        std::cout << "No file system found on disk, use format to create one\n";
+        unsigned no_blocks = std::min<unsigned>(disk.get_no_blocks(), MAX_NO_BLOCKS);
+        setupGeometry(no_blocks, disk.get_block_size());
+        // nothing on the disk can be trusted, not even the FAT and root of
+        // an older layout, so start out empty. the root is left empty
+        // instead of being read, and nothing is written until create or
+        // mkdir formats the disk
+        for (unsigned i = 0; i <= sb.root_blk; i++)
+        {
+            setFat(i, FAT_EOF);
+        }
+        fatDirty.assign(sb.fat_blocks, false);
+        workingDirBlk = sb.root_blk;
+    }
+    else
+    {
+        readInFat();
+    }
     initTree();
-    changeWorkingDir(0);
+    changeWorkingDir(sb.root_blk);
 }
 
 FS::~FS()
 {
-    updateFat();
-    changeWorkingDir(0);
-    writeWorkingDirToBlock(0);
+    // explicit sync point, everything should be on disk once we unmount
+    sync();
     cleanUp();
     delete root;
 }
 
-void FS::cleanUpFiles()
-{
-    for (int i = 0; i < workingDir.size(); i++)
-    {
-        if (workingDir[i]->type == TYPE_FILE)
-        {
-            delete workingDir[i];
-        }
-    }
-}
-
 void FS::cleanUpDirs(treeNode *branch)
 {
-    std::cout << branch->entry->file_name << std::endl;
+    std::cout << branch->entry.file_name << std::endl;
     for (int i = 0; i < branch->children.size(); i++)
     {
         cleanUpDirs(branch->children[i]);
     }
     if (branch != root)
     {
-        delete branch->entry;
         delete branch;
     }
 }
@@ -49,29 +59,99 @@ void FS::cleanUpDirs(treeNode *branch)
 void FS::cleanUp()
 {
     deleteWorkingDir();
+    clearDcache();
     cleanUpDirs(root);
+    nodeIndex.clear();
+    tailBlocks.clear();
 }
 
 void FS::deleteWorkingDir()
 {
-    for (int i = 0; i < workingDir.size(); i++)
+    workingDir.clear();
+    workingDirIndex.clear();
+    workingDirFree.clear();
+    workingDirDirty.clear();
+    workingDirBlk = 0;
+}
+
+// a cached_dir for blk at the front of the dcache, reusing an evicted one
+FS::cached_dir &FS::newCachedDir(uint16_t blk)
+{
+    if (dcacheFree.empty())
+    {
+        dcache.push_front(cached_dir());
+    }
+    else
+    {
+        dcache.splice(dcache.begin(), dcacheFree, dcacheFree.begin());
+    }
+    cached_dir &cd = dcache.front();
+    cd.blk = blk;
+    dcacheIndex[blk] = dcache.begin();
+    return cd;
+}
+
+// moves workingDir into the dcache, evicting the oldest if it is full
+void FS::stashWorkingDir()
+{
+    if (workingDirBlk == 0)
+    {
+        return;
+    }
+    cached_dir &cd = newCachedDir(workingDirBlk);
+    cd.entries.swap(workingDir);
+    cd.index.swap(workingDirIndex);
+    cd.free.swap(workingDirFree);
+    // whatever storage the recycled cached_dir had is now workingDir's.
+    // every change is written out before the working dir changes, so
+    // there are no dirty slots to keep
+    workingDir.clear();
+    workingDirIndex.clear();
+    workingDirFree.clear();
+    workingDirDirty.clear();
+    workingDirBlk = 0;
+    while (dcache.size() > DCACHE_DIRS)
     {
-        delete workingDir[i];
+        dropCachedDir(dcache.back().blk);
     }
 }
 
-dir_entry *FS::makeDotDotDir(uint16_t blk)
+// forgets the parsed directory at blk, its cached_dir goes back to the
+// free list with its storage kept
+void FS::dropCachedDir(uint16_t blk)
+{
+    auto it = dcacheIndex.find(blk);
+    if (it == dcacheIndex.end())
+    {
+        return;
+    }
+    it->second->entries.clear();
+    it->second->index.clear();
+    it->second->free.clear();
+    dcacheFree.splice(dcacheFree.begin(), dcache, it->second);
+    dcacheIndex.erase(it);
+}
+
+void FS::clearDcache()
+{
+    while (!dcache.empty())
+    {
+        dropCachedDir(dcache.back().blk);
+    }
+}
+
+dir_entry FS::makeDotDotDir(uint16_t blk)
 {
     std::cout << "Made DOTDOT point to blk: " << blk << std::endl;
-    dir_entry *dotDotEntry = new dir_entry;
-    dotDotEntry->file_name[0] = '.';
-    dotDotEntry->file_name[1] = '.';
-    dotDotEntry->file_name[2] = '\0';
+    dir_entry dotDotEntry = {};
+    dotDotEntry.file_name[0] = '.';
+    dotDotEntry.file_name[1] = '.';
+    dotDotEntry.file_name[2] = '\0';
 
-    dotDotEntry->first_blk = blk;
-    dotDotEntry->size = '-';
-    dotDotEntry->access_rights = 0x07;
-    dotDotEntry->type = 1;
+    dotDotEntry.first_blk = blk;
+    dotDotEntry.size = '-';
+    dotDotEntry.access_rights = 0x07;
+    dotDotEntry.type = 1;
 
     return dotDotEntry;
 }
@@ -84,7 +164,7 @@ int FS::getSecondNum(uint16_t num)
     return i;
 }
 
-uint32_t FS::convert8to32(uint8_t *result)
+uint32_t FS::convert8to32(const uint8_t *result)
 {
     return (result[0] << 24) | (result[1] << 16) | (result[2] << 8) | result[3];
 }
@@ -99,8 +179,8 @@ void FS::convert32to8(uint32_t num, uint8_t *result)
 
 void FS::convert16to8(uint16_t num, uint8_t *result)
 {
-    result[0] = *((uint8_t *)&(num) + 1);
-    result[1] = *((uint8_t *)&(num) + 0);
+    result[0] = num >> 8;
+    result[1] = num & 0xff;
 }
 
 uint16_t FS::convert8to16(uint8_t num1, uint8_t num2)
@@ -109,136 +189,282 @@ uint16_t FS::convert8to16(uint8_t num1, uint8_t num2)
     return returnVal;
 }
 
-void FS::findEOF(uint16_t first_blk, uint16_t *result)
+// the last block of the file starting at first_blk, from tailBlocks if
+// it is there and still ends the chain, otherwise found through the FAT
+uint16_t FS::lastBlock(uint16_t first_blk)
+{
+    auto it = tailBlocks.find(first_blk);
+    if (it != tailBlocks.end() && fat[it->second] == FAT_EOF)
+    {
+        return it->second;
+    }
+    std::vector<unsigned> chain = getChain(first_blk);
+    uint16_t tail = chain.empty() ? first_blk : chain.back();
+    tailBlocks[first_blk] = tail;
+    return tail;
+}
+
+// returns the block numbers of a file's FAT chain, in order
+std::vector<unsigned> FS::getChain(uint16_t first_blk)
 {
+    std::vector<unsigned> chain;
     int fatIndex = first_blk;
-    uint8_t block[4096];
-    while (fat[fatIndex] != FAT_EOF)
+    // block 0 is the superblock, it never belongs to a file
+    while (fatIndex != FAT_EOF && fatIndex != SUPER_BLOCK &&
+           chain.size() < sb.no_blocks)
     {
+        chain.push_back(fatIndex);
         fatIndex = fat[fatIndex];
     }
-    // Index for the last block
-    result[0] = fatIndex;
-    disk.read(fatIndex, block);
-    // Index where contents end in the last block of the file
-    int i;
-    for (i = 0; i < 4096 && block[i] != '\0'; i++)
-        ;
-    result[1] = i;
+    return chain;
 }
 
-bool FS::dirEmpty(uint16_t blk)
+// the block numbers of blocks start to start + count - 1 of a file's
+// FAT chain, fewer if the chain ends before that. only the FAT entries
+// up to there are followed, none of the blocks are read
+std::vector<unsigned> FS::chainRange(uint16_t first_blk, unsigned start, unsigned count)
 {
-    uint8_t block[4096];
-    disk.read(blk, block);
-    if (block[64] == 0)
+    std::vector<unsigned> blocks;
+    int fatIndex = first_blk;
+    unsigned steps = 0;
+    while (fatIndex != FAT_EOF && fatIndex != SUPER_BLOCK &&
+           blocks.size() < count && steps < sb.no_blocks)
     {
-        return true;
+        if (steps >= start)
+        {
+            blocks.push_back(fatIndex);
+        }
+        fatIndex = fat[fatIndex];
+        steps++;
     }
-    return false;
+    return blocks;
 }
 
-void FS::updateFat()
+// marks every block in the FAT chain starting at first_blk as free
+void FS::freeChain(uint16_t first_blk)
 {
-    uint8_t block[4096];
-    uint8_t bit16[2];
-    uint8_t bit32[4];
-    for (int i = 0; i < 4096; i++)
+    tailBlocks.erase(first_blk);
+    std::vector<unsigned> chain = getChain(first_blk);
+    for (unsigned k = 0; k < chain.size(); k++)
     {
-        block[i] = 0;
+        setFat(chain[k], FAT_FREE);
     }
-    disk.write(1, block);
-    int x = 0;
-    // take each FAT array entry and split it into two 8bit (1 byte)
-    // workingDir which are placed in the block at index x and x+1
-    for (int i = 0; i < BLOCK_SIZE / 2; i++)
+}
+
+// reads count blocks of chain, starting at chain[start], into buffer
+// (count * block size bytes) with one vectored disk read
+int FS::readChainBlocks(const std::vector<unsigned> &chain, unsigned start,
+                        unsigned count, uint8_t *buffer)
+{
+    std::vector<unsigned> blocks(chain.begin() + start, chain.begin() + start + count);
+    std::vector<uint8_t *> blks;
+    for (unsigned j = 0; j < count; j++)
     {
-        convert16to8(fat[i], bit16);
-        block[x] = bit16[0];
-        block[x + 1] = bit16[1];
-        x += 2;
+        blks.push_back(buffer + j * sb.block_size);
     }
-    // write the FAT block
-    disk.write(1, block);
+    return cache.read_blocks(blocks, blks);
 }
 
-void FS::readInFatRoot()
+// writes length bytes to standard output, going around iostream
+int FS::writeStdout(const uint8_t *data, size_t length)
 {
-    uint8_t block[4096];
-    // read the FAT block into block array
-    disk.read(1, block);
-    // counter
-    int x = 0;
-    fat[0] = FAT_EOF;
-    fat[1] = FAT_EOF;
-    // loop through half the size of the FAT block
-    // take 2 bytes each iteration and converting them
-    // too a 16bit (2 byte) INT and adding it to the FAT array
-    // until we have read the whole FAT from file
-    for (int i = 2; i < BLOCK_SIZE / 2; i++)
-    {
-        fat[i] = convert8to16(block[x], block[x + 1]);
-        x += 2;
+    // what is already in cout has to come out first
+    std::cout.flush();
+    size_t done = 0;
+    // write may take less than asked for, keep going until it is all out
+    while (done < length)
+    {
+        ssize_t n = ::write(STDOUT_FILENO, data + done, length - done);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += n;
     }
-    // reset the block array
-    for (int i = 0; i < 4096; i++)
+    return 0;
+}
+
+// a directory is empty when all it has is its ".." entry, which is in
+// the first slot. removed entries leave empty slots, so look at them all
+bool FS::dirEmpty(uint16_t blk)
+{
+    std::vector<unsigned> chain = getChain(blk);
+    unsigned perBlock = sb.block_size / sizeof(disk_dir_entry);
+    for (unsigned k = 0; k < chain.size(); k++)
     {
-        block[i] = 0;
+        const disk_dir_entry *slots = (const disk_dir_entry *)cache.view(chain[k]);
+        for (unsigned i = k == 0 ? 1 : 0; slots != nullptr && i < perBlock; i++)
+        {
+            if (slots[i].file_name[0] != '\0')
+            {
+                return false;
+            }
+        }
     }
-    // read the dir_entry block into block array
-    disk.read(0, block);
-    dir_entry *newDir;
-    uint8_t result[4];
+    return true;
+}
 
-    // loop through dir_entry block until we reach end '\0'
-    // jumps 64 at each iteration since size of dir_entry is 64 bytes.
-    for (int i = 0; i < 4096 && block[i] != '\0'; i += 64)
+// sets a FAT entry and marks its FAT block as changed
+void FS::setFat(unsigned index, int32_t value)
+{
+    if (fat[index] != value)
     {
-        // reset x to point to the first byte of the next dir entry
-        int x = i;
-        // create a new dir
-        newDir = new dir_entry;
+        // keep the free map in step with the FAT
+        if (fat[index] == FAT_FREE)
+        {
+            freeMap[index / 64] &= ~(1ULL << (index % 64));
+            noFree--;
+        }
+        else if (value == FAT_FREE)
+        {
+            freeMap[index / 64] |= 1ULL << (index % 64);
+            noFree++;
+        }
+        fat[index] = value;
+        fatDirty[index / (sb.block_size / 4)] = true;
+    }
+}
 
-        // loop through the 56 bytes of the filename
-        // copy it to newDir filename
-        for (int i = 0; i < 56; i++)
+// writes the FAT blocks that have changed since they were last written
+void FS::updateFat()
+{
+    std::vector<uint8_t> block(sb.block_size);
+    unsigned entriesPerBlock = sb.block_size / 4;
+    for (unsigned b = 0; b < sb.fat_blocks; b++)
+    {
+        if (!fatDirty[b])
         {
-            newDir->file_name[i] = '\0';
+            continue;
         }
-        for (int j = 0; j < 56; j++)
+        // split each 32bit FAT entry in this block into four
+        // 8bit (1 byte) values placed in the block from index x
+        std::fill(block.begin(), block.end(), 0);
+        int x = 0;
+        for (unsigned i = b * entriesPerBlock; i < (b + 1) * entriesPerBlock && i < sb.no_blocks; i++)
         {
-            newDir->file_name[j] = block[x];
-            x++;
+            convert32to8(fat[i], &block[x]);
+            x += 4;
         }
-        // copy the next 4 bytes containing size to reslut array
-        for (int j = 0; j < 4; j++)
+        // write the FAT block
+        cache.write(FAT_BLOCK + b, block.data());
+        fatDirty[b] = false;
+    }
+}
+
+void FS::readInFat()
+{
+    // read the whole FAT in one go
+    std::vector<unsigned> blocks;
+    for (unsigned b = 0; b < sb.fat_blocks; b++)
+    {
+        blocks.push_back(FAT_BLOCK + b);
+    }
+    std::vector<uint8_t> buffer(sb.fat_blocks * sb.block_size);
+    readChainBlocks(blocks, 0, blocks.size(), buffer.data());
+    // take 4 bytes each iteration and convert them to a 32bit INT
+    // in the FAT array until we have read the whole FAT
+    for (unsigned i = 0; i < sb.no_blocks; i++)
+    {
+        fat[i] = (int32_t)convert8to32(&buffer[i * 4]);
+    }
+    fatDirty.assign(sb.fat_blocks, false);
+    buildFreeMap();
+    // the superblock, the FAT itself and the root directory are never free
+    for (unsigned i = 0; i <= sb.root_blk; i++)
+    {
+        if (fat[i] == FAT_FREE)
         {
-            result[j] = block[x];
-            x++;
+            setFat(i, FAT_EOF);
         }
-        // convert the 4 bytes in result array into a 32bit (4 byte) INT
-        // and copy into newDirs size
-        newDir->size = convert8to32(result);
-        // copy the next 2 bytes containing first_blk into result array
-        for (int j = 0; j < 2; j++)
+    }
+}
+
+// sets the bit of every free block in the free map from the FAT
+void FS::buildFreeMap()
+{
+    freeMap.assign((sb.no_blocks + 63) / 64, 0);
+    freeHint = 0;
+    noFree = 0;
+    for (unsigned i = 0; i < sb.no_blocks; i++)
+    {
+        if (fat[i] == FAT_FREE)
         {
-            result[j] = block[x];
-            x++;
+            freeMap[i / 64] |= 1ULL << (i % 64);
+            noFree++;
         }
-        // convert the 2 bytes into one 16bit (2 byte) INT
-        // and copy it to first_blk
-        newDir->first_blk = convert8to16(result[0], result[1]);
-        // copy the next 1 byte straight into the type variable
-        // as it is already a 8bit (1 byte) INT, no conversion needed.
-        newDir->type = block[x];
-        x++;
-        // do the same as for type above for the access_rights.
-        newDir->access_rights = block[x];
-        // push the entry into the workingDir array.
-        workingDir.push_back(newDir);
     }
 }
 
+// fills in sb and sizes the FAT for the given geometry
+void FS::setupGeometry(unsigned no_blocks, unsigned block_size)
+{
+    sb.block_size = block_size;
+    sb.no_blocks = no_blocks;
+    sb.fat_blocks = (no_blocks * 4 + block_size - 1) / block_size;
+    sb.root_blk = FAT_BLOCK + sb.fat_blocks;
+    sb.root_index = 0;
+    fat.assign(no_blocks, FAT_FREE);
+    fatDirty.assign(sb.fat_blocks, false);
+    buildFreeMap();
+}
+
+// reads the superblock and sets up the disk geometry from it,
+// returns -1 if the disk has no valid superblock
+int FS::readSuperBlock()
+{
+    std::vector<uint8_t> block(disk.get_block_size());
+    if (cache.read(SUPER_BLOCK, block.data()) == -1)
+    {
+        return -1;
+    }
+    super_block onDisk;
+    onDisk.magic = convert8to32(&block[0]);
+    onDisk.block_size = convert8to32(&block[4]);
+    onDisk.no_blocks = convert8to32(&block[8]);
+    onDisk.fat_blocks = convert8to32(&block[12]);
+    onDisk.root_blk = convert8to32(&block[16]);
+    onDisk.root_index = convert8to32(&block[20]);
+    if (onDisk.magic != FS_MAGIC ||
+        onDisk.no_blocks > MAX_NO_BLOCKS ||
+        onDisk.block_size < MIN_BLOCK_SIZE || onDisk.block_size > MAX_BLOCK_SIZE)
+    {
+        return -1;
+    }
+    setupGeometry(onDisk.no_blocks, onDisk.block_size);
+    if (sb.fat_blocks != onDisk.fat_blocks || sb.root_blk != onDisk.root_blk ||
+        sb.root_blk >= sb.no_blocks || onDisk.root_index >= sb.no_blocks)
+    {
+        return -1;
+    }
+    sb.magic = onDisk.magic;
+    sb.root_index = onDisk.root_index;
+    // from here on the disk is addressed in the blocks the superblock says
+    cache.invalidate();
+    if (disk.set_geometry(sb.block_size, sb.no_blocks) == -1)
+    {
+        return -1;
+    }
+    std::cout << "Mounted disk with " << sb.no_blocks << " blocks of "
+              << sb.block_size << " bytes\n";
+    return 0;
+}
+
+void FS::writeSuperBlock()
+{
+    std::vector<uint8_t> block(sb.block_size, 0);
+    convert32to8(sb.magic, &block[0]);
+    convert32to8(sb.block_size, &block[4]);
+    convert32to8(sb.no_blocks, &block[8]);
+    convert32to8(sb.fat_blocks, &block[12]);
+    convert32to8(sb.root_blk, &block[16]);
+    convert32to8(sb.root_index, &block[20]);
+    cache.write(SUPER_BLOCK, block.data());
+}
+
 // returns a std:string vector containg all the dirs/files in a given path.
 std::vector<std::string> FS::splitPath(std::string path)
 {
@@ -277,14 +503,13 @@ std::vector<std::string> FS::splitPath(std::string path)
     return pathVector;
 }
 
-// parses a filepath and calls changeDirectory()
-// to change current workingDir to last directory in path
-// if it exists. if doesnt exist it returns -1
+// parses a filepath and changes the current workingDir to the last
+// directory in path if it exists. if doesnt exist it returns -1
 int FS::parsePath(std::string path)
 {
     if (path == "/")
     {
-        changeWorkingDir(ROOT_BLOCK);
+        changeWorkingDir(sb.root_blk);
         return 0;
     }
     if (path[path.length() - 1] == '/')
@@ -292,29 +517,54 @@ int FS::parsePath(std::string path)
         std::cout << "Error: No destination directory selected\n";
         return -1;
     }
-    std::string dirName;
-    int origin = currentNode->entry->first_blk;
-    dirName = parseTilFile(path);
-
-    if (changeDirectory(dirName) == -1)
+    // with a '/' at the end the last name is resolved as a directory too
+    path_handle handle;
+    if (resolvePath(path + "/", handle) == -1)
     {
-        changeWorkingDir(origin);
         return -1;
     }
-
+    enterDir(handle);
     return 0;
 }
 
 // returns filename from path, also changes working directory.
 std::string FS::parseTilFile(std::string path)
+{
+    path_handle handle;
+    if (resolvePath(path, handle) == -1)
+    {
+        return "";
+    }
+    enterDir(handle);
+    return handle.name;
+}
+
+// makes the directory the handle's name is in the working dir
+void FS::enterDir(const path_handle &handle)
+{
+    if (handle.node != currentNode || handle.dir.first_blk != workingDirBlk)
+    {
+        currentNode = handle.node;
+        initWorkingDir(handle.dir.first_blk);
+    }
+}
+
+// resolves path without changing currentNode or workingDir. the
+// directories on the way are found through the tree, the dcache and
+// their hash index, so nothing is read if they are all cached.
+// returns -1 if a directory on the way is missing, a file or not
+// accessible
+int FS::resolvePath(const std::string &path, path_handle &handle)
 {
     int index = 0;
     std::string dirName;
-    int origin = currentNode->entry->first_blk;
+    treeNode *node = currentNode;
+    dir_entry dir = currentNode->entry;
     // if first char is '/' then we know we start in root.
     if (path[0] == '/')
     {
-        changeWorkingDir(ROOT_BLOCK);
+        node = root;
+        dir = root->entry;
         index++;
     }
     for (; index < path.size(); index++)
@@ -322,49 +572,85 @@ std::string FS::parseTilFile(std::string path)
         if (path[index] != '/')
         {
             dirName += path[index];
+            continue;
+        }
+        dir_entry entry;
+        if (lookupEntry(dir, dirName, entry) == -1)
+        {
+            std::cout << "Error: " << dirName << " does not exist\n";
+            std::cout << dirName << " doesn't exist!!!\n";
+            return -1;
+        }
+        // only go on if its a directory we have access to.
+        if (entry.type != TYPE_DIR)
+        {
+            std::cout << "Error: Entry is a file" << std::endl;
+            std::cout << dirName << " doesn't exist!!!\n";
+            return -1;
+        }
+        if (!executePermitted(entry.access_rights))
+        {
+            std::cout << "Error: Permission denied, no access rights" << std::endl;
+            std::cout << dirName << " doesn't exist!!!\n";
+            return -1;
+        }
+        // follow the tree the same way changeWorkingDir does
+        if (entry.first_blk == sb.root_blk)
+        {
+            node = root;
+        }
+        else if (entry.first_blk == node->parent->entry.first_blk)
+        {
+            node = node->parent;
         }
         else
         {
-            if (changeDirectory(dirName) == -1)
-            {
-                std::cout << dirName << " doesn't exist!!!\n";
-                changeWorkingDir(origin);
-                return "";
-            }
-            dirName.clear();
+            node = childNode(node, entry);
         }
-    }
-    return dirName;
+        // ".." entries don't carry the index of the directory they point
+        // at, the tree node does
+        dir = node->entry;
+        dirName.clear();
+    }
+    handle.node = node;
+    handle.dir = dir;
+    handle.name = dirName;
+    handle.found = !dirName.empty() && lookupEntry(dir, dirName, handle.entry) == 0;
+    return 0;
 }
 
-treeNode* FS::BFS(uint16_t blk)
+// returns the tree node of the directory starting at blk, nullptr if
+// that directory hasn't been put in the tree yet
+treeNode* FS::findNode(uint16_t blk)
 {
-    std::cout << "BFS search started..." << std::endl;
-    if (root == nullptr) {
+    auto it = nodeIndex.find(blk);
+    if (it == nodeIndex.end())
+    {
         return nullptr;
     }
-    std::stack<treeNode*> s;
-    s.push(root);
-
-    while (!s.empty()) {
-        treeNode* current = s.top();
-        std::cout << current->entry->file_name << std::endl;
-        if (current->entry->first_blk == blk) {
-            std::cout << "BFS search ended..." << std::endl;
-            return current;
-        }
-        s.pop();
+    return it->second;
+}
 
-        for (int i = 0; i < current->children.size(); i++) {
-            if(current->children[i]->entry->type == TYPE_DIR &&
-            current->children[i]->entry->file_name != DOTDOT)
-            {
-                s.push(current->children[i]);
-            }
-        }
+// moves the tree node of the directory entry to newParent and gives it
+// the entry's name, after a mv. a directory that wasn't in the tree yet
+// gets its node there, newParent may be expanded already
+void FS::moveNode(const dir_entry &entry, treeNode *newParent)
+{
+    treeNode *node = findNode(entry.first_blk);
+    if (node == nullptr)
+    {
+        childNode(newParent, entry);
+        return;
     }
-    std::cout << "BFS search ended..." << std::endl;
-    return nullptr;
+    if (node == root)
+    {
+        return;
+    }
+    std::vector<treeNode *> &siblings = node->parent->children;
+    siblings.erase(std::remove(siblings.begin(), siblings.end(), node), siblings.end());
+    std::copy(entry.file_name, entry.file_name + 56, node->entry.file_name);
+    node->parent = newParent;
+    newParent->children.push_back(node);
 }
 
 // checks if file exists and is a directory, then changes directory
@@ -379,16 +665,16 @@ int FS::changeDirectory(std::string dirName)
     }
 
     // only cd if we have access and its a directory.
-    if (workingDir[index]->type == TYPE_DIR &&
-        executePermitted(workingDir[index]->access_rights))
+    if (workingDir[index].type == TYPE_DIR &&
+        executePermitted(workingDir[index].access_rights))
     {
-        std::cout << currentNode->entry->file_name << std::endl;
-        changeWorkingDir(workingDir[index]->first_blk);
-        std::cout << currentNode->entry->file_name << std::endl;
+        std::cout << currentNode->entry.file_name << std::endl;
+        changeWorkingDir(workingDir[index].first_blk);
+        std::cout << currentNode->entry.file_name << std::endl;
     }
     // error if no execute access to dir.
-    else if (workingDir[index]->type == TYPE_DIR &&
-             !executePermitted(workingDir[index]->access_rights))
+    else if (workingDir[index].type == TYPE_DIR &&
+             !executePermitted(workingDir[index].access_rights))
     {
         std::cout << "Error: Permission denied, no access rights" << std::endl;
         return -1;
@@ -401,245 +687,499 @@ int FS::changeDirectory(std::string dirName)
     return 0;
 }
 
-void FS::initWorkingDir(uint16_t blk)
+// unpacks the 64 byte dir_entry stored at slot
+dir_entry FS::readDirEntry(const disk_dir_entry &slot)
 {
-    updateFat();
-    deleteWorkingDir();
-    workingDir.clear();
+    dir_entry newDir;
+    memcpy(newDir.file_name, slot.file_name, sizeof(slot.file_name));
+    newDir.size = convert8to32(slot.size);
+    newDir.first_blk = convert8to16(slot.first_blk[0], slot.first_blk[1]);
+    newDir.type = slot.type;
+    newDir.access_rights = slot.access_rights;
+    return newDir;
+}
 
-    uint8_t block[4096];
-    // read the dir_entry block into block array
-    disk.read(blk, block);
-    dir_entry *newDir;
-    uint8_t result[4];
+// packs dir into the 64 byte slot
+void FS::writeDirEntry(const dir_entry &dir, disk_dir_entry &slot)
+{
+    memcpy(slot.file_name, dir.file_name, sizeof(slot.file_name));
+    convert32to8(dir.size, slot.size);
+    convert16to8(dir.first_blk, slot.first_blk);
+    slot.type = dir.type;
+    slot.access_rights = dir.access_rights;
+}
 
-    // loop through dir_entry block until we reach end '\0'
-    // jumps 64 at each iteration since size of dir_entry is 64 bytes.
-    for (int i = 0; i < 4096 && block[i] != '\0'; i += 64)
-    {
-        // reset x to point to the first byte of the next dir entry
-        int x = i;
-        // create a new dir
-        newDir = new dir_entry();
+// file_name is only null terminated if it is shorter than 56 chars
+std::string FS::slotName(const disk_dir_entry &slot)
+{
+    return std::string(slot.file_name, strnlen(slot.file_name, sizeof(slot.file_name)));
+}
 
-        // loop through the 56 bytes of the filename
-        // copy it to newDir filename
-        for (int j = 0; j < 56; j++)
-        {
-            newDir->file_name[j] = block[x];
-            x++;
-        }
-        // copy the next 4 bytes containing size to reslut array
-        for (int j = 0; j < 4; j++)
+// reads every block of the directory starting at blk into entries and
+// its name index. an empty slot is a removed entry, it is kept in entries
+// so they line up with the slots on disk and its index goes in free.
+// empty slots at the end are left out
+void FS::readDir(uint16_t blk, std::vector<dir_entry> &entries,
+                 std::unordered_map<std::string, unsigned> &index,
+                 std::vector<unsigned> &free)
+{
+    std::vector<unsigned> chain = getChain(blk);
+    std::vector<uint8_t> buffer(IO_BATCH * sb.block_size);
+    for (unsigned start = 0; start < chain.size(); start += IO_BATCH)
+    {
+        unsigned count = std::min<unsigned>(IO_BATCH, chain.size() - start);
+        readChainBlocks(chain, start, count, buffer.data());
+        const disk_dir_entry *slots = (const disk_dir_entry *)buffer.data();
+        for (size_t i = 0; i < (size_t)count * sb.block_size / sizeof(disk_dir_entry); i++)
         {
-            result[j] = block[x];
-            x++;
+            entries.push_back(readDirEntry(slots[i]));
+            if (emptySlot(entries.back()))
+            {
+                free.push_back(entries.size() - 1);
+                continue;
+            }
+            // keep the first one if a name is in the directory twice
+            index.emplace(entryName(entries.back()), entries.size() - 1);
         }
-        // convert the 4 bytes in result array into a 32bit (4 byte) INT
-        // and copy into newDirs size
-        newDir->size = convert8to32(result);
-        // copy the next 2 bytes containing first_blk into result array
-        for (int j = 0; j < 2; j++)
+    }
+    while (!entries.empty() && emptySlot(entries.back()))
+    {
+        entries.pop_back();
+        free.pop_back();
+    }
+}
+
+// returns the parsed entries of the directory at blk, from workingDir or
+// the dcache if it is there, otherwise it is read into the dcache
+const std::vector<dir_entry> &FS::parsedDir(uint16_t blk)
+{
+    if (blk == workingDirBlk)
+    {
+        return workingDir;
+    }
+    auto it = dcacheIndex.find(blk);
+    if (it == dcacheIndex.end())
+    {
+        cached_dir &cd = newCachedDir(blk);
+        readDir(blk, cd.entries, cd.index, cd.free);
+        while (dcache.size() > DCACHE_DIRS)
         {
-            result[j] = block[x];
-            x++;
+            dropCachedDir(dcache.back().blk);
         }
-        // convert the 2 bytes into one 16bit (2 byte) INT
-        // and copy it to first_blk
-        newDir->first_blk = convert8to16(result[0], result[1]);
-        // copy the next 1 byte straight into the type variable
-        // as it is already a 8bit (1 byte) INT, no conversion needed.
-        newDir->type = block[x];
-        x++;
-        // do the same as for type above for the access_rights.
-        newDir->access_rights = block[x];
-        // push the entry into the workingDir array.
-        workingDir.push_back(newDir);
+        return dcache.front().entries;
+    }
+    // now the most recently used
+    dcache.splice(dcache.begin(), dcache, it->second);
+    return it->second->entries;
+}
+
+// reads the directory starting at blk into workingDir. a directory that
+// is still in the dcache is taken from there instead
+void FS::initWorkingDir(uint16_t blk)
+{
+    if (blk == workingDirBlk)
+    {
+        return;
+    }
+    stashWorkingDir();
+    workingDirBlk = blk;
+    auto it = dcacheIndex.find(blk);
+    if (it != dcacheIndex.end())
+    {
+        // the cached_dir keeps the storage workingDir had and goes back
+        // to the free list
+        workingDir.swap(it->second->entries);
+        workingDirIndex.swap(it->second->index);
+        workingDirFree.swap(it->second->free);
+        dcacheFree.splice(dcacheFree.begin(), dcache, it->second);
+        dcacheIndex.erase(it);
+        return;
     }
+    readDir(blk, workingDir, workingDirIndex, workingDirFree);
 }
 
 void FS::changeWorkingDir(uint16_t blk)
 {
-    updateFat();
+    treeNode *node = findNode(blk);
+    if (node == nullptr)
+    {
+        // not in the tree yet, it has to be a sub-directory of this one
+        expandNode(currentNode);
+        node = findNode(blk);
+    }
+    if (node != nullptr)
+    {
+        currentNode = node;
+    }
 
-    uint8_t block[4096];
+    initWorkingDir(blk);
+}
 
-    if (blk == ROOT_BLOCK)
+void FS::initTree()
+{
+    // we need to initialize root treeNode so it has a parent and a dir_entry,
+    // think thats why we get unitialized bytes.
+    dir_entry newDir;
+    for (int i = 0; i < 56; i++)
     {
-        currentNode = root;
+        newDir.file_name[i] = '\0';
     }
-    else if (blk == currentNode->parent->entry->first_blk)
+    newDir.file_name[0] = '/';
+    newDir.file_name[1] = '\0';
+    newDir.first_blk = sb.root_blk;
+    newDir.size = sb.root_index != 0 ? DIR_INDEXED | sb.root_index : '-';
+    newDir.type = TYPE_DIR;
+    newDir.access_rights = READ + WRITE;
+    root = new treeNode(nullptr, newDir);
+    root->parent = root;
+    currentNode = root;
+    nodeIndex.clear();
+    nodeIndex[sb.root_blk] = root;
+
+    // the rest of the tree is filled in as directories are visited
+    changeWorkingDir(sb.root_blk);
+    std::cout << "Ended\n";
+}
+
+// adds tree nodes for all the sub-directories of node the first time
+// they are needed, the ones already there are kept
+void FS::expandNode(treeNode *node)
+{
+    if (node->expanded)
     {
-        currentNode = currentNode->parent;
+        return;
     }
-    else
+    const std::vector<dir_entry> &entries = parsedDir(node->entry.first_blk);
+    for (unsigned i = 0; i < entries.size(); i++)
     {
-        for (int i = 0; i < currentNode->children.size(); i++)
+        if (entries[i].type == TYPE_DIR && entries[i].file_name != DOTDOT)
         {
-            if (currentNode->children[i]->entry->first_blk == blk)
-            {
-                currentNode = currentNode->children[i];
-                break;
-            }
+            childNode(node, entries[i]);
         }
     }
+    node->expanded = true;
+}
 
-    deleteWorkingDir();
-    // cleanUpFiles();
-    workingDir.clear();
-    // read the dir_entry block into block array
-    disk.read(blk, block);
-    dir_entry *newDir;
-    uint8_t result[4];
+// returns the tree node of the sub-directory entry of node, making it if
+// it isn't there yet
+treeNode *FS::childNode(treeNode *node, const dir_entry &entry)
+{
+    for (int i = 0; i < node->children.size(); i++)
+    {
+        if (node->children[i]->entry.first_blk == entry.first_blk)
+        {
+            return node->children[i];
+        }
+    }
+    treeNode *newBranch = new treeNode(node, entry);
+    node->children.push_back(newBranch);
+    nodeIndex[entry.first_blk] = newBranch;
+    return newBranch;
+}
 
-    // loop through dir_entry block until we reach end '\0'
-    // jumps 64 at each iteration since size of dir_entry is 64 bytes.
-    for (int i = 0; i < 4096 && block[i] != '\0'; i += 64)
+// writes the changes to workingDir back to the directory starting at blk.
+// the directory grows and shrinks a block at a time through the FAT, and
+// only the slots in workingDirDirty are written. a directory of more than
+// one block also has its hash index brought up to date. returns -1 if the
+// disk is too full for the directory to grow, nothing is changed then
+int FS::writeWorkingDirToBlock(uint16_t blk)
+{
+    unsigned perBlock = sb.block_size / sizeof(disk_dir_entry);
+    std::vector<unsigned> chain = getChain(blk);
+    if (chain.empty())
+    {
+        return -1;
+    }
+    treeNode *node = findNode(blk);
+    unsigned oldLength = chain.size();
+    unsigned needed = std::max<unsigned>(1, (workingDir.size() + perBlock - 1) / perBlock);
+    bool hasIndex = node != nullptr && (node->entry.size & DIR_INDEXED);
+    bool wantIndex = node != nullptr && needed > 1;
+    unsigned extra = (needed > chain.size() ? needed - chain.size() : 0) +
+                     (wantIndex && !hasIndex ? 1 : 0);
+    if (extra > noFree)
     {
-        // reset x to point to the first byte of the next dir entry
-        int x = i;
-        // create a new dir
-        newDir = new dir_entry();
+        std::cout << "Error: Disk is full\n";
+        return -1;
+    }
+    if (needed > chain.size())
+    {
+        // link new blocks onto the end, right after the last one if free
+        std::vector<unsigned> added = allocateBlocks(needed - chain.size(), chain.back() + 1);
+        setFat(chain.back(), added[0]);
+        chain.insert(chain.end(), added.begin(), added.end());
+    }
+    else if (needed < chain.size())
+    {
+        // give back the blocks at the end that are no longer used
+        setFat(chain[needed - 1], FAT_EOF);
+        for (unsigned k = needed; k < chain.size(); k++)
+        {
+            setFat(chain[k], FAT_FREE);
+        }
+        chain.resize(needed);
+    }
 
-        // loop through the 56 bytes of the filename
-        // copy it to newDir filename
-        for (int j = 0; j < 56; j++)
+    // blocks new to the directory are written whole
+    std::vector<uint8_t> block(sb.block_size);
+    disk_dir_entry *slots = (disk_dir_entry *)block.data();
+    for (unsigned k = oldLength; k < chain.size(); k++)
+    {
+        std::fill(block.begin(), block.end(), 0);
+        for (unsigned i = k * perBlock; i < (k + 1) * perBlock && i < workingDir.size(); i++)
         {
-            newDir->file_name[j] = block[x];
-            x++;
+            writeDirEntry(workingDir[i], slots[i - k * perBlock]);
         }
-        // copy the next 4 bytes containing size to reslut array
-        for (int j = 0; j < 4; j++)
+        cache.write(chain[k], block.data());
+    }
+    // in the blocks it already had only the slots that changed are
+    // patched, straight in the cached block
+    unsigned kept = std::min<unsigned>(oldLength, chain.size());
+    for (unsigned d = 0; d < workingDirDirty.size(); d++)
+    {
+        unsigned slot = workingDirDirty[d];
+        if (slot / perBlock >= kept)
         {
-            result[j] = block[x];
-            x++;
+            continue;
         }
-        // convert the 4 bytes in result array into a 32bit (4 byte) INT
-        // and copy into newDirs size
-        newDir->size = convert8to32(result);
-        // copy the next 2 bytes containing first_blk into result array
-        for (int j = 0; j < 2; j++)
+        disk_dir_entry packed = {};
+        if (slot < workingDir.size())
         {
-            result[j] = block[x];
-            x++;
+            writeDirEntry(workingDir[slot], packed);
+        }
+        const disk_dir_entry *old = (const disk_dir_entry *)cache.view(chain[slot / perBlock]);
+        if (old != nullptr && memcmp(&old[slot % perBlock], &packed, sizeof(packed)) != 0)
+        {
+            ((disk_dir_entry *)cache.modify(chain[slot / perBlock]))[slot % perBlock] = packed;
         }
-        // convert the 2 bytes into one 16bit (2 byte) INT
-        // and copy it to first_blk
-        newDir->first_blk = convert8to16(result[0], result[1]);
-        // copy the next 1 byte straight into the type variable
-        // as it is already a 8bit (1 byte) INT, no conversion needed.
-        newDir->type = block[x];
-        x++;
-        // do the same as for type above for the access_rights.
-        newDir->access_rights = block[x];
-        // push the entry into the workingDir array.
-        workingDir.push_back(newDir);
     }
+
+    if (wantIndex)
+    {
+        uint16_t index_blk;
+        if (hasIndex)
+        {
+            index_blk = node->entry.size & 0xffff;
+        }
+        else
+        {
+            index_blk = allocateBlocks(1, chain.back() + 1)[0];
+            setDirIndex(node, index_blk);
+        }
+        const uint8_t *index = hasIndex && chain.size() == oldLength ? cache.view(index_blk) : nullptr;
+        unsigned leafBits = index != nullptr ? convert8to32(index) : 0;
+        if (leafBits >= chain.size())
+        {
+            // same leaves as before, only the names added need their bit set.
+            // the bit of a removed name is left, it only costs a wasted read
+            unsigned buckets = std::max<unsigned>(1, (sb.block_size - 4) * 8 / leafBits);
+            for (unsigned d = 0; d < workingDirDirty.size(); d++)
+            {
+                unsigned slot = workingDirDirty[d];
+                if (slot >= workingDir.size() || emptySlot(workingDir[slot]))
+                {
+                    continue;
+                }
+                size_t bit = (size_t)(nameHash(entryName(workingDir[slot])) % buckets) * leafBits + slot / perBlock;
+                if (bit / 8 + 4 < sb.block_size && !((index[4 + bit / 8] >> (bit % 8)) & 1))
+                {
+                    uint8_t *changed = cache.modify(index_blk);
+                    changed[4 + bit / 8] |= 1 << (bit % 8);
+                    index = changed;
+                }
+            }
+        }
+        else
+        {
+            buildDirIndex(chain.size(), block);
+            if (index == nullptr || memcmp(index, block.data(), sb.block_size) != 0)
+            {
+                cache.write(index_blk, block.data());
+            }
+        }
+    }
+    else if (hasIndex)
+    {
+        // back down to one block, lookups read that block anyway
+        setFat(node->entry.size & 0xffff, FAT_FREE);
+        setDirIndex(node, 0);
+    }
+    workingDirDirty.clear();
+    return 0;
 }
 
-void FS::initTree()
+// FNV-1a
+uint32_t FS::nameHash(const std::string &name)
 {
-    // we need to initialize root treeNode so it has a parent and a dir_entry,
-    // think thats why we get unitialized bytes.
-    root = new treeNode;
-    root->parent = root;
-    currentNode = root;
-    dir_entry *newDir = new dir_entry();
-    for (int i = 0; i < 56; i++)
+    uint32_t hash = 2166136261u;
+    for (unsigned i = 0; i < name.size(); i++)
     {
-        newDir->file_name[i] = '\0';
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
-    newDir->file_name[0] = '/';
-    newDir->file_name[1] = '\0';
-    newDir->first_blk = ROOT_BLOCK;
-    newDir->size = '-';
-    newDir->type = TYPE_DIR;
-    newDir->access_rights = READ + WRITE;
-    root->entry = newDir;
-
-    // start recursion
-    initTreeContinued(root);
-
-    changeWorkingDir(ROOT_BLOCK);
-    std::cout << "Ended\n";
+    return hash;
 }
 
-void FS::initTreeContinued(treeNode *pBranch)
+// fills block with the hash index of workingDir spread over noLeaves blocks.
+// the first 4 bytes are the number of leaf bits per bucket, a power of two,
+// followed by the buckets. a set bit only says the name may be in that leaf
+void FS::buildDirIndex(unsigned noLeaves, std::vector<uint8_t> &block)
 {
-    std::cout << "Current branch: " << pBranch->entry->file_name << std::endl;
-
-    // read in working dir.
-    for (int i = 0; i < workingDir.size(); i++)
+    unsigned perBlock = sb.block_size / 64;
+    unsigned leafBits = 1;
+    while (leafBits < noLeaves)
+    {
+        leafBits <<= 1;
+    }
+    // with more leaves than fit in one bucket every leaf has to be read
+    unsigned buckets = std::max<unsigned>(1, (sb.block_size - 4) * 8 / leafBits);
+    std::fill(block.begin(), block.end(), 0);
+    convert32to8(leafBits, &block[0]);
+    for (unsigned i = 0; i < workingDir.size(); i++)
     {
-        if (workingDir[i]->type == TYPE_DIR && workingDir[i]->file_name != DOTDOT)
+        if (emptySlot(workingDir[i]))
         {
-            treeNode *newBranch = new treeNode(pBranch, workingDir[i]);
-            std::cout << "Adding to children: " << workingDir[i]->file_name << std::endl;
-
-            pBranch->children.push_back(newBranch);
+            continue;
+        }
+        size_t bit = (size_t)(nameHash(entryName(workingDir[i])) % buckets) * leafBits + i / perBlock;
+        if (bit / 8 + 4 < sb.block_size)
+        {
+            block[4 + bit / 8] |= 1 << (bit % 8);
         }
     }
-    // call recursively for all children directories that are not DOTDOT.
-    for (int i = 0; i < pBranch->children.size(); i++)
+}
+
+// records the index block of a directory in its dir_entry, both in the
+// tree and on disk in the parent directory (the superblock for root)
+void FS::setDirIndex(treeNode *node, uint16_t index_blk)
+{
+    uint32_t size = index_blk != 0 ? DIR_INDEXED | index_blk : '-';
+    node->entry.size = size;
+    if (node == root)
     {
-        initWorkingDir(pBranch->children[i]->entry->first_blk);
-        std::cout << "Recursion: " << pBranch->children[i]->entry->file_name << std::endl;
-        initTreeContinued(pBranch->children[i]);
+        sb.root_index = index_blk;
+        writeSuperBlock();
+        return;
     }
+    patchEntry(node->parent->entry.first_blk, entryName(node->entry), size,
+               node->entry.first_blk);
 }
 
-void FS::writeWorkingDirToBlock(uint16_t blk)
+// sets size and first_blk of the entry called name in the directory at
+// dir_blk, in its parsed copy if there is one and in its block on disk.
+// for changing a directory other than the one being written out
+void FS::patchEntry(uint16_t dir_blk, const std::string &name, uint32_t size, uint16_t first_blk)
 {
-    uint8_t block[4096];
-    uint8_t bit16[2];
-    uint8_t bit32[4];
-
-    for (int i = 0; i < 4096; i++)
+    std::vector<dir_entry> *entries = nullptr;
+    std::unordered_map<std::string, unsigned> *index = nullptr;
+    auto it = dcacheIndex.find(dir_blk);
+    if (dir_blk == workingDirBlk)
     {
-        block[i] = 0;
+        entries = &workingDir;
+        index = &workingDirIndex;
     }
+    else if (it != dcacheIndex.end())
+    {
+        entries = &it->second->entries;
+        index = &it->second->index;
+    }
+    if (entries != nullptr && index->count(name))
+    {
+        dir_entry &entry = (*entries)[index->at(name)];
+        entry.size = size;
+        entry.first_blk = first_blk;
+    }
+    std::vector<unsigned> chain = getChain(dir_blk);
+    unsigned perBlock = sb.block_size / sizeof(disk_dir_entry);
+    for (unsigned k = 0; k < chain.size(); k++)
+    {
+        const disk_dir_entry *slots = (const disk_dir_entry *)cache.view(chain[k]);
+        if (slots == nullptr)
+        {
+            return;
+        }
+        for (unsigned i = 0; i < perBlock; i++)
+        {
+            if (slots[i].file_name[0] != '\0' && name == slotName(slots[i]))
+            {
+                // only this slot of the cached block changes
+                disk_dir_entry &slot = ((disk_dir_entry *)cache.modify(chain[k]))[i];
+                convert32to8(size, slot.size);
+                convert16to8(first_blk, slot.first_blk);
+                return;
+            }
+        }
+    }
+}
 
-    int x = 0;
-
-    // size of a dir_entry is 64 bytes
-    for (int i = 0; i < workingDir.size(); i++)
+// looks up name in the directory dir without reading all of it in, only
+// the index block and the leaf blocks it points at are read.
+// returns -1 if the name is not there
+int FS::lookupEntry(const dir_entry &dir, const std::string &name, dir_entry &result)
+{
+    // a directory that is already parsed needs no reads at all
+    if (dir.first_blk == workingDirBlk)
+    {
+        int index = findIndexWorkingDir(name);
+        if (index == -1)
+        {
+            return -1;
+        }
+        result = workingDir[index];
+        return 0;
+    }
+    auto it = dcacheIndex.find(dir.first_blk);
+    if (it != dcacheIndex.end())
+    {
+        auto found = it->second->index.find(name);
+        if (found == it->second->index.end())
+        {
+            return -1;
+        }
+        result = it->second->entries[found->second];
+        return 0;
+    }
+    std::vector<unsigned> chain = getChain(dir.first_blk);
+    std::vector<bool> candidate(chain.size(), true);
+    const uint8_t *block = nullptr;
+    if (chain.size() > 1 && (dir.size & DIR_INDEXED) &&
+        (block = cache.view(dir.size & 0xffff)) != nullptr)
     {
-        // loop through file_name char array
-        // adding each char into the block array
-        for (int j = 0; j < 56; j++)
+        unsigned leafBits = convert8to32(&block[0]);
+        // an index made for fewer leaves than the directory has is no use
+        if (leafBits >= chain.size())
         {
-            block[x] = workingDir[i]->file_name[j];
-            x++;
+            unsigned buckets = std::max<unsigned>(1, (sb.block_size - 4) * 8 / leafBits);
+            size_t row = (size_t)(nameHash(name) % buckets) * leafBits;
+            for (unsigned k = 0; k < chain.size(); k++)
+            {
+                size_t bit = row + k;
+                candidate[k] = bit / 8 + 4 >= sb.block_size || ((block[4 + bit / 8] >> (bit % 8)) & 1);
+            }
         }
-        // convert one 32 bit (4 bytes) INT to four 8bit (1 byte) INTs
-        // saved in var "bit32"
-        convert32to8(workingDir[i]->size, bit32);
-        // add each of the four 8bit (1 byte) INTs to the block.
-        for (int j = 0; j < 4; j++)
+    }
+    for (unsigned k = 0; k < chain.size(); k++)
+    {
+        if (!candidate[k])
         {
-            block[x] = bit32[j];
-            x++;
+            continue;
         }
-        // convert 16bit (2 byte) first_blk into two
-        // 8bit (1 byte) INTs
-        convert16to8(workingDir[i]->first_blk, bit16);
-        // add each of the two 8bit (1 byte) INTs to the block.
-        for (int j = 0; j < 2; j++)
+        const disk_dir_entry *slots = (const disk_dir_entry *)cache.view(chain[k]);
+        if (slots == nullptr)
         {
-            block[x] = bit16[j];
-            x++;
+            return -1;
+        }
+        for (unsigned i = 0; i < sb.block_size / sizeof(disk_dir_entry); i++)
+        {
+            // an empty slot is a removed entry
+            if (slots[i].file_name[0] != '\0' && name == slotName(slots[i]))
+            {
+                result = readDirEntry(slots[i]);
+                return 0;
+            }
         }
-        // add the type which is already a 8bit (1 byte) INT to the block.
-        block[x] = workingDir[i]->type;
-        x++;
-        // add the access_rights which is already a 8bit (1 byte) INT to the block.
-        block[x] = workingDir[i]->access_rights;
-        x++;
     }
-    // write the dir_entry block
-    disk.write(blk, block);
-
-    updateFat();
+    return -1;
 }
 
 int FS::findIndexWorkingDirFromBlock(uint16_t blk)
@@ -650,7 +1190,7 @@ int FS::findIndexWorkingDirFromBlock(uint16_t blk)
     uint16_t first_blk = 0;
     for (int i = 0; i < workingDir.size(); i++)
     {
-        if (workingDir[i]->first_blk == blk)
+        if (!emptySlot(workingDir[i]) && workingDir[i].first_blk == blk)
         {
             found = true;
             index = i;
@@ -663,59 +1203,89 @@ int FS::findIndexWorkingDirFromBlock(uint16_t blk)
 // returns index in workingDir array, -1 if not found
 int FS::findIndexWorkingDir(std::string filename)
 {
-    bool found = false;
-    // Tries to find entry in workingDir
-    int index = -1;
-    uint16_t first_blk = 0;
-    for (int i = 0; i < workingDir.size(); i++)
+    auto it = workingDirIndex.find(filename);
+    if (it == workingDirIndex.end())
     {
-        if (workingDir[i]->file_name == filename)
-        {
-            found = true;
-            index = i;
-            break;
-        }
+        return -1;
     }
-    // return index
-    return index;
+    return it->second;
 }
 // return index of first block, -1 if not found.
 int FS::findBlockWorkingDir(std::string filename)
 {
-    bool found = false;
-    // Tries to find file in rootblock
-    uint16_t first_blk = 0;
-    for (int i = 0; i < workingDir.size(); i++)
+    int index = findIndexWorkingDir(filename);
+    if (index == -1)
     {
-        if (workingDir[i]->file_name == filename)
-        {
-            first_blk = workingDir[i]->first_blk;
-            found = true;
-            break;
-        }
+        return -1;
+    }
+    return workingDir[index].first_blk;
+}
+
+bool FS::fileExist(std::string filename)
+{
+    return workingDirIndex.count(filename) > 0;
+}
+
+// file_name is only null terminated if it is shorter than 56 chars
+std::string FS::entryName(const dir_entry &entry)
+{
+    return std::string(entry.file_name, strnlen(entry.file_name, 56));
+}
+
+// adds an entry to workingDir and the name index, in the most recently
+// emptied slot if there is one, otherwise at the end
+unsigned FS::addWorkingDirEntry(const dir_entry &entry)
+{
+    // slots past the end or filled again since they were freed are stale
+    while (!workingDirFree.empty() &&
+           (workingDirFree.back() >= workingDir.size() || !emptySlot(workingDir[workingDirFree.back()])))
+    {
+        workingDirFree.pop_back();
     }
-    // return index of first block
-    if (found)
+    unsigned slot;
+    if (workingDirFree.empty())
     {
-        return first_blk;
+        slot = workingDir.size();
+        workingDir.push_back(entry);
     }
-    return -1;
+    else
+    {
+        slot = workingDirFree.back();
+        workingDirFree.pop_back();
+        workingDir[slot] = entry;
+    }
+    // keep the first one if a name is in the directory twice
+    workingDirIndex.emplace(entryName(entry), slot);
+    workingDirDirty.push_back(slot);
+    return slot;
 }
 
-bool FS::fileExist(std::string filename)
+// takes the entry at index out of workingDir and the name index. its
+// slot is left empty, the other entries stay where they are. empty slots
+// at the end are dropped so the directory can shrink. returns a copy of
+// the entry
+dir_entry FS::removeWorkingDirEntry(unsigned index)
 {
-    bool found = false;
-    // Tries to find file
-    for (int i = 0; i < workingDir.size(); i++)
+    dir_entry entry = workingDir[index];
+    auto it = workingDirIndex.find(entryName(entry));
+    if (it != workingDirIndex.end() && it->second == index)
     {
-        if (workingDir[i]->file_name == filename)
-        {
-            found = true;
-            break;
-        }
+        workingDirIndex.erase(it);
+    }
+    workingDir[index] = dir_entry();
+    workingDirFree.push_back(index);
+    workingDirDirty.push_back(index);
+    while (!workingDir.empty() && emptySlot(workingDir.back()))
+    {
+        workingDir.pop_back();
     }
-    // return index of first block
-    return found;
+    return entry;
+}
+
+// marks workingDir[index] as changed so writeWorkingDirToBlock writes it
+void FS::markWorkingDirEntry(unsigned index)
+{
+    workingDirDirty.push_back(index);
 }
 
 uint8_t FS::parseRights(std::string rights)
@@ -798,20 +1368,156 @@ bool FS::executePermitted(int rights)
 }
 
 
-// return first free block index
+// return a free block index, -2 if the disk is full. the search starts
+// at the free map word where the last one ended, so with most of the
+// disk in use it doesnt have to walk past all the taken blocks again
 int FS::getFreeIndex()
 {
-    for (int i = 0; i < BLOCK_SIZE / 2; i++)
+    if (noFree == 0)
     {
-        if (fat[i] == FAT_FREE)
+        return -2;
+    }
+    unsigned words = freeMap.size();
+    for (unsigned n = 0; n < words; n++)
+    {
+        unsigned w = (freeHint + n) % words;
+        if (freeMap[w] != 0)
         {
-            return i;
+            freeHint = w;
+            return w * 64 + __builtin_ctzll(freeMap[w]);
         }
     }
-
     return -2;
 }
 
+// returns every run of contiguous free blocks, in block order
+std::vector<FS::extent> FS::findFreeRuns()
+{
+    std::vector<extent> runs;
+    unsigned i = 0;
+    while (i < sb.no_blocks)
+    {
+        // skip whole free map words with no free block in them
+        if (i % 64 == 0 && freeMap[i / 64] == 0)
+        {
+            i += 64;
+            continue;
+        }
+        if (!((freeMap[i / 64] >> (i % 64)) & 1))
+        {
+            i++;
+            continue;
+        }
+        extent run;
+        run.start = i;
+        while (i < sb.no_blocks && ((freeMap[i / 64] >> (i % 64)) & 1))
+        {
+            // and go past whole words where everything is free
+            if (i % 64 == 0 && freeMap[i / 64] == ~0ULL)
+            {
+                i += 64;
+            }
+            else
+            {
+                i++;
+            }
+        }
+        run.length = std::min(i, sb.no_blocks) - run.start;
+        runs.push_back(run);
+    }
+    return runs;
+}
+
+// reserves count free blocks and links them into a chain ending in EOF.
+// returns an empty vector if there is not enough free space
+std::vector<unsigned> FS::allocateBlocks(unsigned count, int goal)
+{
+    std::vector<unsigned> blocks;
+    if (count == 0 || count > noFree)
+    {
+        return blocks;
+    }
+    std::vector<extent> picked;
+    extent piece;
+
+    // let a file grow in place if the blocks right after it are free,
+    // that is looked up in the free map without going over the runs
+    if (goal >= 0 && goal + count <= sb.no_blocks)
+    {
+        unsigned b = goal;
+        while (b < goal + count && ((freeMap[b / 64] >> (b % 64)) & 1))
+        {
+            b++;
+        }
+        if (b == goal + count)
+        {
+            piece.start = goal;
+            piece.length = count;
+            picked.push_back(piece);
+        }
+    }
+    // any single free block will do, the hint finds one without a scan
+    if (picked.empty() && count == 1)
+    {
+        piece.start = getFreeIndex();
+        piece.length = 1;
+        picked.push_back(piece);
+    }
+    // otherwise take the smallest run that fits the whole request,
+    // that leaves the bigger runs for bigger files
+    std::vector<extent> runs;
+    if (picked.empty())
+    {
+        runs = findFreeRuns();
+        int best = -1;
+        for (unsigned i = 0; i < runs.size(); i++)
+        {
+            if (runs[i].length >= count &&
+                (best == -1 || runs[i].length < runs[best].length))
+            {
+                best = i;
+            }
+        }
+        if (best != -1)
+        {
+            piece.start = runs[best].start;
+            piece.length = count;
+            picked.push_back(piece);
+        }
+    }
+    // no run is big enough, use the biggest runs so the file ends up
+    // in as few fragments as possible, then put them in disk order
+    if (picked.empty())
+    {
+        std::sort(runs.begin(), runs.end(),
+                  [](const extent &a, const extent &b) { return a.length > b.length; });
+        unsigned left = count;
+        for (unsigned i = 0; i < runs.size() && left > 0; i++)
+        {
+            piece.start = runs[i].start;
+            piece.length = std::min(left, runs[i].length);
+            picked.push_back(piece);
+            left -= piece.length;
+        }
+        std::sort(picked.begin(), picked.end(),
+                  [](const extent &a, const extent &b) { return a.start < b.start; });
+    }
+
+    for (unsigned i = 0; i < picked.size(); i++)
+    {
+        for (unsigned j = 0; j < picked[i].length; j++)
+        {
+            blocks.push_back(picked[i].start + j);
+        }
+    }
+    // link up the chain
+    for (unsigned i = 0; i < blocks.size(); i++)
+    {
+        setFat(blocks[i], i + 1 < blocks.size() ? (int32_t)blocks[i + 1] : FAT_EOF);
+    }
+    return blocks;
+}
+
 void FS::testDisk()
 {
     std::cout << std::endl;
@@ -822,196 +1528,253 @@ void FS::testDisk()
     
 }
 
-int FS::writeBlocksFromString(std::string filepath, std::string contents, uint16_t startFatIndex, int blockIndex)
+// appends length bytes of the file starting at src_blk to the file whose
+// last block is tail, which has offset bytes in use (1 to a whole block,
+// 0 only for an empty file). the source is streamed IO_BATCH blocks at a
+// time, so only the blocks that change are read and written. returns the
+// new last block, -1 if there isn't room for it, nothing is changed then
+int FS::appendChain(uint16_t src_blk, size_t length, uint16_t tail, unsigned offset)
 {
-    uint8_t block[4096];
-    int firstFatIndex = 0;
-    int prevIndex = FAT_EOF;
+    // the source chain is taken before it can grow, appending a file to
+    // itself copies what it had
+    std::vector<unsigned> src = getChain(src_blk);
+    length = std::min<size_t>(length, (size_t)src.size() * sb.block_size);
+    if (length == 0)
+    {
+        return tail;
+    }
+    // reserve every block the appended contents need up front, right
+    // after the current last block if that space is free
+    size_t total = offset + length;
+    unsigned noNew = (total - 1) / sb.block_size;
+    std::vector<unsigned> newBlocks = allocateBlocks(noNew, tail + 1);
+    if (noNew > 0 && newBlocks.empty())
+    {
+        std::cout << "Error: Disk is full\n";
+        return -1;
+    }
+    if (noNew > 0)
+    {
+        setFat(tail, newBlocks[0]);
+    }
 
-    disk.read(startFatIndex, block);
-
-    // start writing blocks
-    int count = blockIndex;
-    int fatIndex = 0;
-    fatIndex = startFatIndex;
-    firstFatIndex = fatIndex;
-    for (int i = 0; i < contents.size(); i++)
-    {
-        // if file is bigger than size of 1 block (4096 bytes)
-        if (count > 4095)
-        {
-            // write block to file
-            disk.write(fatIndex, block);
-            // save previous fatIndex
-            prevIndex = fatIndex;
-            // set prevIndex as EOF temporarily so
-            // so getFreeIndex doesnt choose it.
-            fat[prevIndex] = FAT_EOF;
-            // get a new free block index
-            fatIndex = getFreeIndex();
-            // set prev FAT index next block as current fatIndex
-            fat[prevIndex] = fatIndex;
-            // reset block
-            for (int j = 0; j < 4096; j++)
+    // out is the block being filled, starting with what the tail has
+    // unless the tail is full already
+    std::vector<uint8_t> out(sb.block_size, 0);
+    unsigned next = 0;
+    unsigned dst = tail;
+    unsigned pos = offset;
+    if (pos == sb.block_size)
+    {
+        dst = newBlocks[next++];
+        pos = 0;
+    }
+    else
+    {
+        cache.read(tail, out.data());
+    }
+    std::vector<uint8_t> buffer(IO_BATCH * sb.block_size);
+    size_t remaining = length;
+    for (unsigned start = 0; start < src.size() && remaining > 0; start += IO_BATCH)
+    {
+        unsigned count = std::min<unsigned>(IO_BATCH, src.size() - start);
+        readChainBlocks(src, start, count, buffer.data());
+        size_t have = std::min<size_t>(remaining, (size_t)count * sb.block_size);
+        const uint8_t *from = buffer.data();
+        while (have > 0)
+        {
+            if (pos == sb.block_size)
             {
-                block[j] = 0;
+                // this block is full, move on to the next of the reserved ones
+                cache.write(dst, out.data());
+                dst = newBlocks[next++];
+                std::fill(out.begin(), out.end(), 0);
+                pos = 0;
             }
-            // reset count so we can continue
-            // writing the remaining file contents to the reset block
-            count = 0;
-            // std::cout << "fatIndex: " << fatIndex << std::endl;
-            // std::cout << "prevIndex: " << prevIndex << std::endl;
+            size_t n = std::min<size_t>(have, sb.block_size - pos);
+            memcpy(&out[pos], from, n);
+            pos += n;
+            from += n;
+            have -= n;
+            remaining -= n;
         }
-        // add each char from file contents into block.
-        block[count] = contents[i];
-        count++;
     }
-
-    // write last block
-    fat[fatIndex] = FAT_EOF;
-    disk.write(fatIndex, block);
-
-    return firstFatIndex;
+    cache.write(dst, out.data());
+    return dst;
 }
 
-// help function for cp return first block index
+// help function for create return first block index
 int FS::writeBlocksFromString(std::string contents)
 {
-    uint8_t block[4096];
-    int firstFatIndex = 0;
-    int prevIndex = FAT_EOF;
+    // an empty file still has a block, first_blk has to point somewhere
+    unsigned noBlocks = std::max<size_t>(1, (contents.size() + sb.block_size - 1) / sb.block_size);
 
-    // start writing blocks
-    int count = 0;
-    int fatIndex = 0;
-    fatIndex = getFreeIndex();
-    firstFatIndex = fatIndex;
-    // add null termination to content
-    contents.push_back('\0');
-
-    for (int i = 0; i < contents.size(); i++)
-    {
-        // if file is bigger than size of 1 block (4096 bytes)
-        if (count >= 4096)
-        {
-            // write block to file
-            disk.write(fatIndex, block);
-            // save previous fatIndex
-            prevIndex = fatIndex;
-            // set prevIndex as EOF temporarily so
-            // so getFreeIndex doesnt choose it.
-            fat[prevIndex] = FAT_EOF;
-            // get a new free block index
-            fatIndex = getFreeIndex();
-            // set prev FAT index next block as current fatIndex
-            fat[prevIndex] = fatIndex;
-            // reset block
-            for (int j = 0; j < 4096; j++)
-            {
-                block[j] = 0;
-            }
-            // reset count so we can continue
-            // writing the remaining file contents to the reset block
-            count = 0;
-            // std::cout << "fatIndex: " << fatIndex << std::endl;
-            // std::cout << "prevIndex: " << prevIndex << std::endl;
-        }
-        // add each char from file contents into block.
-        block[count] = contents[i];
-        count++;
+    // reserve and link up the whole chain in the FAT first, as one run of
+    // blocks if possible, so the blocks can then be written in as few
+    // disk calls as possible
+    std::vector<unsigned> chain = allocateBlocks(noBlocks);
+    if (chain.empty())
+    {
+        std::cout << "Error: Disk is full\n";
+        return -1;
     }
 
-    // write last block
-    fat[fatIndex] = FAT_EOF;
-    disk.write(fatIndex, block);
+    std::vector<uint8_t> buffer(IO_BATCH * sb.block_size);
+    std::vector<unsigned> blocks;
+    std::vector<uint8_t *> blks;
+    for (unsigned start = 0; start < noBlocks; start += IO_BATCH)
+    {
+        unsigned count = std::min<unsigned>(IO_BATCH, noBlocks - start);
+        size_t offset = (size_t)start * sb.block_size;
+        size_t length = std::min<size_t>(count * sb.block_size, contents.size() - offset);
+        // copy the contents over and zero the tail of the last block
+        std::fill(buffer.begin(), buffer.end(), 0);
+        std::copy(contents.begin() + offset, contents.begin() + offset + length, buffer.begin());
+        blocks.assign(chain.begin() + start, chain.begin() + start + count);
+        blks.clear();
+        for (unsigned j = 0; j < count; j++)
+        {
+            blks.push_back(buffer.data() + j * sb.block_size);
+        }
+        cache.write_blocks(blocks, blks);
+    }
 
     std::cout << "Added contents to blocks\n";
-    return firstFatIndex;
+    return chain[0];
 }
 
-dir_entry *FS::copyDirEntry(dir_entry *dir)
+// copies the blocks of the chain starting at first_blk to a new chain,
+// IO_BATCH blocks at a time so only that much is ever held in memory.
+// returns the first block of the copy, -1 if the disk is too full
+int FS::copyChain(uint16_t first_blk)
 {
-    // copy over the dir entry
-    dir_entry *newEntry = new dir_entry;
-    for (int i = 0; i < 56; i++)
+    std::vector<unsigned> src = getChain(first_blk);
+    // the whole copy is reserved up front, as one run if there is one
+    std::vector<unsigned> dst = allocateBlocks(src.size());
+    if (dst.empty())
     {
-        newEntry->file_name[i] = dir->file_name[i];
+        std::cout << "Error: Disk is full\n";
+        return -1;
     }
-    newEntry->first_blk = dir->first_blk;
-    newEntry->size = dir->size;
-    newEntry->access_rights = dir->access_rights;
-    newEntry->type = dir->type;
 
-    return newEntry;
+    std::vector<uint8_t> buffer(IO_BATCH * sb.block_size);
+    std::vector<unsigned> blocks;
+    std::vector<uint8_t *> blks;
+    for (unsigned start = 0; start < src.size(); start += IO_BATCH)
+    {
+        unsigned count = std::min<unsigned>(IO_BATCH, src.size() - start);
+        readChainBlocks(src, start, count, buffer.data());
+        blocks.assign(dst.begin() + start, dst.begin() + start + count);
+        blks.clear();
+        for (unsigned j = 0; j < count; j++)
+        {
+            blks.push_back(buffer.data() + j * sb.block_size);
+        }
+        cache.write_blocks(blocks, blks);
+    }
+
+    std::cout << "Added contents to blocks\n";
+    return dst[0];
 }
 
-dir_entry *FS::copyDirEntry(dir_entry *dir, std::string name)
+// commit point, writes the FAT blocks that changed and then all
+// dirty cached blocks back to the disk
+int FS::commit()
 {
-    // copy over the dir entry
-    dir_entry *newEntry = new dir_entry;
-    name.push_back('\0');
-    for (int i = 0; i < 56 && i < name.size(); i++)
+    updateFat();
+    if (cache.sync() == -1)
     {
-        newEntry->file_name[i] = name[i];
+        return 1;
     }
-    newEntry->first_blk = dir->first_blk;
-    newEntry->size = dir->size;
-    newEntry->access_rights = dir->access_rights;
-    newEntry->type = dir->type;
-
-    return newEntry;
+    return 0;
 }
 
-dir_entry *FS::copyDirEntry(dir_entry *dir, std::string name, uint16_t first_blk)
+// commits and then flushes the disk file itself
+int FS::sync()
 {
-    // copy over the dir entry
-    dir_entry *newEntry = new dir_entry;
-    name.push_back('\0');
-    for (int i = 0; i < 56 && i < name.size(); i++)
+    if (commit() != 0)
     {
-        newEntry->file_name[i] = name[i];
+        return 1;
     }
-    newEntry->first_blk = first_blk;
-    newEntry->size = dir->size;
-    newEntry->access_rights = dir->access_rights;
-    newEntry->type = dir->type;
-
-    return newEntry;
+    if (disk.sync() == -1)
+    {
+        return 1;
+    }
+    return 0;
 }
 
 // formats the disk, i.e., creates an empty file system
+// with the same geometry as before
 int FS::format()
 {
-    changeWorkingDir(0);
-    uint8_t block[4096];
-    // reset the block array
-    for (int i = 0; i < 4096; i++)
+    return format(sb.no_blocks, sb.block_size);
+}
+
+// a disk without a file system is mounted empty but nothing on it is
+// set up, so the first command that adds something formats it. without
+// the superblock, the whole FAT and an empty root the change would be
+// lost, or mixed with an older image, at the next mount
+int FS::formatIfBlank()
+{
+    if (sb.magic == FS_MAGIC)
+    {
+        return 0;
+    }
+    std::cout << "No file system on disk, formatting it first\n";
+    return format();
+}
+
+// format <no_blocks> <block_size> formats the disk with a new geometry
+int FS::format(unsigned no_blocks, unsigned block_size)
+{
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+        (block_size & (block_size - 1)) != 0)
+    {
+        std::cout << "Block size has to be a power of two between "
+                  << MIN_BLOCK_SIZE << " and " << MAX_BLOCK_SIZE << "\n";
+        return 1;
+    }
+    // room for the superblock, the FAT, the root directory and one more block
+    unsigned fatBlocks = (no_blocks * 4 + block_size - 1) / block_size;
+    if (no_blocks > MAX_NO_BLOCKS || no_blocks < FAT_BLOCK + fatBlocks + 2)
+    {
+        std::cout << "Number of blocks has to be between "
+                  << FAT_BLOCK + fatBlocks + 2 << " and " << MAX_NO_BLOCKS << "\n";
+        return 1;
+    }
+    // the cache holds blocks of the old size, empty it before resizing the disk
+    cache.invalidate();
+    if (disk.set_geometry(block_size, no_blocks) == -1)
     {
-        block[i] = 0;
+        return 2;
     }
-    // overwrite all blocks
-    for (int i = 0; i < BLOCK_SIZE / 2; i++)
+
+    // throw away the old directory tree
+    cleanUp();
+    delete root;
+
+    setupGeometry(no_blocks, block_size);
+    sb.magic = FS_MAGIC;
+    // the superblock, FAT and root directory blocks are taken, the rest is free
+    for (unsigned i = 0; i <= sb.root_blk; i++)
     {
-        disk.write(i, block);
+        setFat(i, FAT_EOF);
     }
-    fat[ROOT_BLOCK] = FAT_EOF;
-    fat[FAT_BLOCK] = FAT_EOF;
-    for (int i = 2; i < BLOCK_SIZE / 2; i++)
+    // every FAT block has to go out, the old FAT may still be on disk
+    fatDirty.assign(sb.fat_blocks, true);
+    // reset the metadata blocks, data blocks are always written
+    // in full when they are handed out so they can be left as is
+    std::vector<uint8_t> block(sb.block_size, 0);
+    for (unsigned i = 0; i <= sb.root_blk; i++)
     {
-        fat[i] = FAT_FREE;
+        cache.write(i, block.data());
     }
-    updateFat();
-
-    deleteWorkingDir();
-    workingDir.clear();
+    writeSuperBlock();
 
-    readInFatRoot();
     initTree();
-    changeWorkingDir(0);
     // create DOTDOT entry for ROOT.
-    dir_entry *dotDotDir = makeDotDotDir(ROOT_BLOCK);
-    workingDir.push_back(dotDotDir);
-    writeWorkingDirToBlock(ROOT_BLOCK);
+    addWorkingDirEntry(makeDotDotDir(sb.root_blk));
+    writeWorkingDirToBlock(sb.root_blk);
 
     return 0;
 }
@@ -1020,7 +1783,11 @@ int FS::format()
 // written on the following rows (ended with an empty row)
 int FS::create(std::string filepath)
 {
-    uint16_t origin = currentNode->entry->first_blk;
+    if (formatIfBlank() != 0)
+    {
+        return 1;
+    }
+    uint16_t origin = currentNode->entry.first_blk;
     std::string srcName = parseTilFile(filepath);
     if (srcName.length() > 56)
     {
@@ -1037,7 +1804,7 @@ int FS::create(std::string filepath)
     std::cout << "FS::create(" << filepath << ")\n";
     std::string contents;
     std::string row = "";
-    uint8_t block[4096];
+    std::vector<uint8_t> block(sb.block_size);
     int firstFatIndex = 0;
     int prevIndex = FAT_EOF;
 
@@ -1053,29 +1820,38 @@ int FS::create(std::string filepath)
         row.push_back('\n');
         contents.append(row);
     }
-    // add null termination to end of file.
-    contents.push_back('\0');
-
     // create new file and save its first block.
     firstFatIndex = writeBlocksFromString(contents);
+    if (firstFatIndex == -1)
+    {
+        changeWorkingDir(origin);
+        return 2;
+    }
 
     std::cout << "Added contents to blocks\n";
     std::cout << "Wrote file to blk: " << firstFatIndex << std::endl;
 
-    dir_entry *newEntry = new dir_entry;
+    dir_entry newEntry = {};
     filepath.push_back('\0');
     for (int i = 0; i < 56 && i < filepath.size(); i++)
     {
-        newEntry->file_name[i] = srcName[i];
+        newEntry.file_name[i] = srcName[i];
     }
-    newEntry->first_blk = firstFatIndex;
-    newEntry->size = contents.size();
-    newEntry->access_rights = 0x06;
-    newEntry->type = 0;
-    workingDir.push_back(newEntry);
-    std::cout << "Added file to dir: " << currentNode->entry->file_name << std::endl;
+    newEntry.first_blk = firstFatIndex;
+    newEntry.size = contents.size();
+    newEntry.access_rights = 0x06;
+    newEntry.type = 0;
+    unsigned slot = addWorkingDirEntry(newEntry);
+    std::cout << "Added file to dir: " << currentNode->entry.file_name << std::endl;
 
-    writeWorkingDirToBlock(currentNode->entry->first_blk);
+    if (writeWorkingDirToBlock(currentNode->entry.first_blk) == -1)
+    {
+        // no room to grow the directory, give the file's blocks back
+        removeWorkingDirEntry(slot);
+        freeChain(firstFatIndex);
+        changeWorkingDir(origin);
+        return 2;
+    }
     changeWorkingDir(origin);
     return 0;
 }
@@ -1083,43 +1859,47 @@ int FS::create(std::string filepath)
 // cat <filepath> reads the content of a file and prints it on the screen
 int FS::cat(std::string filepath)
 {
-    int origin = currentNode->entry->first_blk;
     std::cout << "FS::cat(" << filepath << ")\n";
-    std::string fileName = parseTilFile(filepath);
-    std::cout << fileName << std::endl;
-
-    // Tries to find file in rootblock
-    int first_blk = findBlockWorkingDir(fileName);
+    // reading doesn't need the working dir to change
+    path_handle file;
+    if (resolvePath(filepath, file) == -1)
+    {
+        return 1;
+    }
+    std::cout << file.name << std::endl;
 
     // if file cannot be found, throw error.
-    if (first_blk == -1)
+    if (!file.found)
     {
         return 1;
     }
-    int index = findIndexWorkingDir(fileName);
-    if (workingDir[index]->type == TYPE_DIR)
+    if (file.entry.type == TYPE_DIR)
     {
         return 2;
     }
-    if (!readPermitted(workingDir[index]->access_rights))
+    if (!readPermitted(file.entry.access_rights))
     {
         std::cout << "Not allowed to read this file\n";
         return 3;
     }
 
-    uint8_t block[4096];
-    int fatIndex = first_blk;
-    while (fatIndex != FAT_EOF && first_blk != 0)
+    std::vector<unsigned> chain = getChain(file.entry.first_blk);
+    std::vector<uint8_t> buffer(IO_BATCH * sb.block_size);
+    // read the file IO_BATCH blocks at a time and write each batch out in
+    // one go, the size says where the file ends
+    size_t remaining = file.entry.size;
+    for (unsigned start = 0; start < chain.size() && remaining > 0; start += IO_BATCH)
     {
-        std::cout << "Current Block Index: " << fatIndex << std::endl;
-        disk.read(fatIndex, block);
-        for (int i = 0; i < 4096 && block[i] != '\0'; i++)
+        unsigned count = std::min<unsigned>(IO_BATCH, chain.size() - start);
+        readChainBlocks(chain, start, count, buffer.data());
+        size_t length = std::min<size_t>(remaining, (size_t)count * sb.block_size);
+        if (writeStdout(buffer.data(), length) == -1)
         {
-            std::cout << block[i];
+            std::cout << "Error: Can't write to standard output\n";
+            return 4;
         }
-        fatIndex = fat[fatIndex];
+        remaining -= length;
     }
-    changeWorkingDir(origin);
     return 0;
 }
 
@@ -1131,24 +1911,28 @@ int FS::ls()
     // print files and directories
     for (int i = 0; i < workingDir.size(); i++)
     {
-        if (workingDir[i]->type == TYPE_DIR)
+        if (emptySlot(workingDir[i]))
+        {
+            continue;
+        }
+        if (workingDir[i].type == TYPE_DIR)
         {
             // print dir
             std::cout
-                << workingDir[i]->file_name
+                << workingDir[i].file_name
                 << '\t' << "dir"
-                << '\t' << readRights(workingDir[i]->access_rights)
-                << '\t' << '\t' << (char)workingDir[i]->size
+                << '\t' << readRights(workingDir[i].access_rights)
+                << '\t' << '\t' << '-'
                 << '\n';
         }
         else
         {
             // print file
             std::cout
-                << workingDir[i]->file_name
+                << workingDir[i].file_name
                 << '\t' << "file"
-                << '\t' << readRights(workingDir[i]->access_rights)
-                << '\t' << '\t' << workingDir[i]->size
+                << '\t' << readRights(workingDir[i].access_rights)
+                << '\t' << '\t' << workingDir[i].size
                 << '\n';
         }
     }
@@ -1162,50 +1946,42 @@ int FS::cp(std::string sourcepath, std::string destpath)
     treeNode *originNode = currentNode;
     std::cout << "FS::cp(" << sourcepath << "," << destpath << ")\n";
     // Tries to find file in rootblock
-    uint16_t origin = currentNode->entry->first_blk;
+    uint16_t origin = currentNode->entry.first_blk;
     uint16_t first_blk = 0;
-    uint8_t block[4096];
     int dstEntryIndex = 0;
-    int srcEntryIndex = 0;
-    std::string contents = "";
     uint8_t destType = 0;
-    std::string srcName = parseTilFile(sourcepath);
-    srcEntryIndex = findIndexWorkingDir(srcName);
-    if (!readPermitted(workingDir[srcEntryIndex]->access_rights))
+    // slot the copy's entry goes in
+    unsigned newSlot = 0;
+    // the source is only read, find it without changing directory
+    path_handle src;
+    if (resolvePath(sourcepath, src) == -1)
     {
-        std::cout << "Not allowed to copy this file\n";
-        changeWorkingDir(origin);
-        currentNode = originNode;
         return 1;
     }
-    // Tries to find file in rootblock
-    first_blk = findBlockWorkingDir(srcName);
+    std::string srcName = src.name;
     // if source file cannot be found, or is a directory throw error.
-    // read in all the from the sourcefile blocks to contents.
-
-    dir_entry *newEntry = new dir_entry;
-    newEntry->access_rights = workingDir[srcEntryIndex]->access_rights;
-    newEntry->size = workingDir[srcEntryIndex]->size;
-    newEntry->type = workingDir[srcEntryIndex]->type;
-
-    int fatIndex = first_blk;
-    while (fatIndex != FAT_EOF && first_blk != 0)
+    if (!src.found || src.entry.type == TYPE_DIR)
     {
-        // std::cout << "fatIndex: " << fatIndex << std::endl;
-        disk.read(fatIndex, block);
-        for (int i = 0; i < 4096 && block[i] != '\0'; i++)
-        {
-            contents.push_back(block[i]);
-        }
-        fatIndex = fat[fatIndex];
+        std::cout << "Error: " << srcName << " is not a file\n";
+        return 1;
     }
-    changeWorkingDir(origin);
+    if (!readPermitted(src.entry.access_rights))
+    {
+        std::cout << "Not allowed to copy this file\n";
+        return 1;
+    }
+
+    dir_entry newEntry = {};
+    newEntry.access_rights = src.entry.access_rights;
+    newEntry.size = src.entry.size;
+    newEntry.type = src.entry.type;
+
     std::string dstName = parseTilFile(destpath);
     dstEntryIndex = findIndexWorkingDir(dstName);
 
     if (dstEntryIndex != -1)
     {
-        destType = workingDir[dstEntryIndex]->type;
+        destType = workingDir[dstEntryIndex].type;
     }
 
     // if destination exists and is a directory
@@ -1223,22 +1999,36 @@ int FS::cp(std::string sourcepath, std::string destpath)
             currentNode = originNode;
             return 1;
         }
-        first_blk = writeBlocksFromString(contents);
-        for (int i = 0; i < 56; i++)
+        int written = copyChain(src.entry.first_blk);
+        if (written == -1)
+        {
+            changeWorkingDir(origin);
+            currentNode = originNode;
+            return 2;
+        }
+        first_blk = written;
+        for (int i = 0; i < 56 && i < srcName.size(); i++)
         {
-            newEntry->file_name[i] = srcName[i];
+            newEntry.file_name[i] = srcName[i];
         }
         // copy over the dir entry, for file to file copy
-        newEntry->first_blk = first_blk;
+        newEntry.first_blk = first_blk;
 
-        workingDir.push_back(newEntry);
+        newSlot = addWorkingDirEntry(newEntry);
     }
     // otherwise we just copy file in currentDir
     else if (dstEntryIndex == -1)
     {
         // just copying file in current dir
         // create new file and save its first block. for file to file copy
-        first_blk = writeBlocksFromString(contents);
+        int written = copyChain(src.entry.first_blk);
+        if (written == -1)
+        {
+            changeWorkingDir(origin);
+            currentNode = originNode;
+            return 2;
+        }
+        first_blk = written;
         if (fileExist(dstName))
         {
             std::cout << "Error: File with that name already exist\n";
@@ -1246,16 +2036,16 @@ int FS::cp(std::string sourcepath, std::string destpath)
             currentNode = originNode;
             return -1;
         }
-        for (int i = 0; i < 56; i++)
+        for (int i = 0; i < 56 && i < dstName.size(); i++)
         {
-            newEntry->file_name[i] = dstName[i];
+            newEntry.file_name[i] = dstName[i];
         }
         // copy over the dir entry, for file to file copy
-        newEntry->first_blk = first_blk;
+        newEntry.first_blk = first_blk;
 
         std::cout << "destination is currentDir" << std::endl;
 
-        workingDir.push_back(newEntry);
+        newSlot = addWorkingDirEntry(newEntry);
     }
     else
     {
@@ -1266,7 +2056,14 @@ int FS::cp(std::string sourcepath, std::string destpath)
     }
 
     // save to disk
-    writeWorkingDirToBlock(currentNode->entry->first_blk);
+    if (writeWorkingDirToBlock(currentNode->entry.first_blk) == -1)
+    {
+        removeWorkingDirEntry(newSlot);
+        freeChain(first_blk);
+        changeWorkingDir(origin);
+        currentNode = originNode;
+        return 2;
+    }
     changeWorkingDir(origin);
     currentNode = originNode;
 
@@ -1280,36 +2077,39 @@ int FS::mv(std::string sourcepath, std::string destpath)
     treeNode *originNode = currentNode;
 
     std::cout << "FS::mv(" << sourcepath << "," << destpath << ")\n";
-    int origin = currentNode->entry->first_blk;
+    int origin = currentNode->entry.first_blk;
     std::string srcName = parseTilFile(sourcepath);
     int srcIndex = findIndexWorkingDir(srcName);
-    if (srcName.size() == 0 || srcIndex == -1)
+    if (srcName.size() == 0 || srcIndex == -1 || srcName == DOTDOT)
     {
         std::cout << "First parameter invalid\n";
         return 1;
     }
-    dir_entry *temp = workingDir[srcIndex];
-    workingDir.erase(workingDir.begin() + srcIndex);
-    writeWorkingDirToBlock(currentNode->entry->first_blk);
+    dir_entry temp = removeWorkingDirEntry(srcIndex);
+    writeWorkingDirToBlock(currentNode->entry.first_blk);
+    treeNode *srcNode = currentNode;
     changeWorkingDir(origin);
     std::string dstName = parseTilFile(destpath);
     int dstIndex = findIndexWorkingDir(dstName);
+    unsigned dstSlot = 0;
 
-    if (dstIndex != -1 && workingDir[dstIndex]->type == TYPE_DIR)
+    if (dstIndex != -1 && workingDir[dstIndex].type == TYPE_DIR)
     {
         changeDirectory(dstName);
 
-        if (fileExist(srcName))
+        if (fileExist(srcName) ||
+            (temp.type == TYPE_DIR && temp.first_blk == currentNode->entry.first_blk))
         {
             std::cout << "Error: File with that name already exist\n";
+            changeWorkingDir(srcNode->entry.first_blk);
+            currentNode = srcNode;
+            addWorkingDirEntry(temp);
+            writeWorkingDirToBlock(currentNode->entry.first_blk);
             changeWorkingDir(origin);
             currentNode = originNode;
-            workingDir.push_back(temp);
-            writeWorkingDirToBlock(currentNode->entry->first_blk);
             return 1;
         }
-        workingDir.push_back(temp);
-        temp = nullptr;
+        dstSlot = addWorkingDirEntry(temp);
     }
     else if (dstIndex == -1)
     {
@@ -1317,37 +2117,63 @@ int FS::mv(std::string sourcepath, std::string destpath)
         if (fileExist(dstName))
         {
             std::cout << "Error: File with that name already exist\n";
+            changeWorkingDir(srcNode->entry.first_blk);
+            currentNode = srcNode;
+            addWorkingDirEntry(temp);
+            writeWorkingDirToBlock(currentNode->entry.first_blk);
             changeWorkingDir(origin);
             currentNode = originNode;
-            workingDir.push_back(temp);
-            writeWorkingDirToBlock(currentNode->entry->first_blk);
             return 1;
         }
         // reset filename to empty
         for (int i = 0; i < 56; i++)
         {
-            temp->file_name[i] = 0;
+            temp.file_name[i] = 0;
         }
         // rename file
         for (int i = 0; i < destpath.size() && i < 56; i++)
         {
-            temp->file_name[i] = dstName[i];
+            temp.file_name[i] = dstName[i];
         }
-        std::cout << temp->file_name << "\n";
+        std::cout << temp.file_name << "\n";
 
-        workingDir.push_back(temp);
+        dstSlot = addWorkingDirEntry(temp);
     }
     else
     {
+        changeWorkingDir(srcNode->entry.first_blk);
+        currentNode = srcNode;
+        addWorkingDirEntry(temp);
+        writeWorkingDirToBlock(currentNode->entry.first_blk);
         changeWorkingDir(origin);
         currentNode = originNode;
-        workingDir.push_back(temp);
-        writeWorkingDirToBlock(currentNode->entry->first_blk);
         std::cout << "Error: Destinationfile already exists\n";
         return 1;
     }
 
-    writeWorkingDirToBlock(currentNode->entry->first_blk);
+    if (writeWorkingDirToBlock(currentNode->entry.first_blk) == -1)
+    {
+        // the destination directory couldnt grow, put the entry back
+        // where it came from, that directory has room for it
+        removeWorkingDirEntry(dstSlot);
+        changeWorkingDir(srcNode->entry.first_blk);
+        currentNode = srcNode;
+        addWorkingDirEntry(temp);
+        writeWorkingDirToBlock(currentNode->entry.first_blk);
+        changeWorkingDir(origin);
+        currentNode = originNode;
+        return 2;
+    }
+    if (temp.type == TYPE_DIR)
+    {
+        // a moved directory gets a new parent in the tree and its ".."
+        // has to point there as well
+        if (currentNode != srcNode)
+        {
+            patchEntry(temp.first_blk, DOTDOT, '-', currentNode->entry.first_blk);
+        }
+        moveNode(temp, currentNode);
+    }
     changeWorkingDir(origin);
     currentNode = originNode;
     return 0;
@@ -1363,28 +2189,40 @@ int FS::rm(std::string filepath)
         return 1;
     }
     int entryIndex = findIndexWorkingDir(filepath);
-    if (workingDir[entryIndex]->type == TYPE_FILE)
+    if (workingDir[entryIndex].type == TYPE_FILE)
     {
-        int fatIndex = workingDir[entryIndex]->first_blk;
+        int fatIndex = workingDir[entryIndex].first_blk;
         int nextIndex = fatIndex;
+        tailBlocks.erase(fatIndex);
         while (nextIndex != FAT_EOF && nextIndex != 0)
         {
             std::cout << "Removing block: " << fatIndex << "\n";
             nextIndex = fat[fatIndex];
-            fat[fatIndex] = FAT_FREE;
+            setFat(fatIndex, FAT_FREE);
             fatIndex = nextIndex;
         }
         // Erases the dir entry from the vector
-        workingDir.erase(workingDir.begin() + entryIndex);
+        removeWorkingDirEntry(entryIndex);
     }
-    else if (workingDir[entryIndex]->type == TYPE_DIR)
+    else if (workingDir[entryIndex].type == TYPE_DIR)
     {
         // check dir is empty and isnt a special ".." directory
-        if (dirEmpty(workingDir[entryIndex]->first_blk) &&
-            workingDir[entryIndex]->file_name != DOTDOT)
+        if (dirEmpty(workingDir[entryIndex].first_blk) &&
+            workingDir[entryIndex].file_name != DOTDOT)
         {
-            fat[workingDir[entryIndex]->first_blk] = FAT_FREE;
-            workingDir.erase(workingDir.begin() + entryIndex);
+            uint16_t dirBlk = workingDir[entryIndex].first_blk;
+            // take it out of the tree if it is there
+            treeNode *node = findNode(dirBlk);
+            if (node != nullptr)
+            {
+                std::vector<treeNode *> &siblings = node->parent->children;
+                siblings.erase(std::remove(siblings.begin(), siblings.end(), node), siblings.end());
+                nodeIndex.erase(dirBlk);
+                delete node;
+            }
+            dropCachedDir(dirBlk);
+            freeChain(dirBlk);
+            removeWorkingDirEntry(entryIndex);
         }
         else
         {
@@ -1393,7 +2231,7 @@ int FS::rm(std::string filepath)
     }
 
     // write to disk
-    writeWorkingDirToBlock(currentNode->entry->first_blk);
+    writeWorkingDirToBlock(currentNode->entry.first_blk);
 
     return 0;
 }
@@ -1404,66 +2242,234 @@ int FS::append(std::string filepath1, std::string filepath2)
 {
     treeNode *originNode = currentNode;
     std::cout << "FS::append(" << filepath1 << "," << filepath2 << ")\n";
-    uint16_t origin = currentNode->entry->first_blk;
-    std::string srcName = parseTilFile(filepath1);
-    int entryIndex = findIndexWorkingDir(srcName);
-    if (!readPermitted(workingDir[entryIndex]->access_rights))
+    uint16_t origin = currentNode->entry.first_blk;
+    // the source is only read, find it without changing directory
+    path_handle src;
+    if (resolvePath(filepath1, src) == -1)
     {
-        std::cout << "Not allowed to read src file\n";
         return 1;
     }
-    uint8_t block[4096];
-
-    int fatIndex = workingDir[entryIndex]->first_blk;
-    std::string contents;
-    // String block
-    std::string sBlock;
-    // Result array for finding end of destfile both in blocks and inside of block
-    uint16_t result[2];
-    int i = 0;
-    // Reads every block from sourcefile into string
-    while (fatIndex != FAT_EOF)
-    {
-        std::cout << "Iteration"
-                  << "\n";
-        disk.read(fatIndex, block);
-        sBlock = (char *)block;
-        contents.append(sBlock);
-        fatIndex = fat[fatIndex];
+    if (!src.found || src.entry.type == TYPE_DIR)
+    {
+        std::cout << "Error: " << src.name << " is not a file\n";
+        return 1;
     }
-    contents.push_back('\0');
-    changeWorkingDir(origin);
+    if (!readPermitted(src.entry.access_rights))
+    {
+        std::cout << "Not allowed to read src file\n";
+        return 1;
+    }
+    size_t length = src.entry.size;
     std::string dstName = parseTilFile(filepath2);
-    entryIndex = findIndexWorkingDir(dstName);
-    if (!writePermitted(workingDir[entryIndex]->access_rights))
+    int entryIndex = findIndexWorkingDir(dstName);
+    if (entryIndex == -1 || workingDir[entryIndex].type == TYPE_DIR)
+    {
+        std::cout << "Error: " << dstName << " is not a file\n";
+        changeWorkingDir(origin);
+        currentNode = originNode;
+        return 2;
+    }
+    if (!writePermitted(workingDir[entryIndex].access_rights))
     {
         std::cout << "Not allowed to write to destination file\n";
+        changeWorkingDir(origin);
+        currentNode = originNode;
         return 2;
     }
 
-    // Returns last block in file and last index in the block
-    findEOF(workingDir[entryIndex]->first_blk, result);
-    int count = result[1];
-    fatIndex = result[0];
-    // Writes string into EOF block at the given position in the last block
-    // (i.e., where the contents in the block ends)
-    // and onwards into new blocks if needed
-    writeBlocksFromString(filepath2, contents, fatIndex, count);
-    workingDir[entryIndex]->size += contents.size();
+    // the end of the destination comes from its size, how much of its
+    // last block is used
+    uint16_t dst_blk = workingDir[entryIndex].first_blk;
+    uint32_t size = workingDir[entryIndex].size;
+    unsigned offset = size > 0 ? (size - 1) % sb.block_size + 1 : 0;
+    int tail = appendChain(src.entry.first_blk, length, lastBlock(dst_blk), offset);
+    if (tail == -1)
+    {
+        changeWorkingDir(origin);
+        currentNode = originNode;
+        return 2;
+    }
+    tailBlocks[dst_blk] = tail;
+    workingDir[entryIndex].size += length;
+    markWorkingDirEntry(entryIndex);
 
-    writeWorkingDirToBlock(currentNode->entry->first_blk);
+    writeWorkingDirToBlock(currentNode->entry.first_blk);
     changeWorkingDir(origin);
     currentNode = originNode;
 
     return 0;
 }
 
+// copies up to length bytes of the file at filepath, starting offset bytes
+// in, into buffer. the FAT is followed to the block offset is in and only
+// the blocks that hold the range are read. returns how many bytes were
+// read, fewer than length at the end of the file, -1 on error
+ssize_t FS::read(std::string filepath, size_t offset, size_t length, uint8_t *buffer)
+{
+    path_handle file;
+    if (resolvePath(filepath, file) == -1)
+    {
+        return -1;
+    }
+    if (!file.found || file.entry.type == TYPE_DIR)
+    {
+        std::cout << "Error: " << file.name << " is not a file\n";
+        return -1;
+    }
+    if (!readPermitted(file.entry.access_rights))
+    {
+        std::cout << "Not allowed to read this file\n";
+        return -1;
+    }
+    if (offset >= file.entry.size || length == 0)
+    {
+        return 0;
+    }
+    length = std::min<size_t>(length, file.entry.size - offset);
+
+    unsigned first = offset / sb.block_size;
+    unsigned last = (offset + length - 1) / sb.block_size;
+    std::vector<unsigned> chain = chainRange(file.entry.first_blk, first, last - first + 1);
+    std::vector<uint8_t> blocks(IO_BATCH * sb.block_size);
+    size_t done = 0;
+    // only the first block is read from part way in
+    size_t skip = offset % sb.block_size;
+    for (unsigned start = 0; start < chain.size() && done < length; start += IO_BATCH)
+    {
+        unsigned count = std::min<unsigned>(IO_BATCH, chain.size() - start);
+        if (readChainBlocks(chain, start, count, blocks.data()) == -1)
+        {
+            return -1;
+        }
+        size_t n = std::min<size_t>(length - done, (size_t)count * sb.block_size - skip);
+        memcpy(buffer + done, blocks.data() + skip, n);
+        done += n;
+        skip = 0;
+    }
+    return done;
+}
+
+// writes length bytes from buffer into the file at filepath, starting
+// offset bytes in. the FAT is followed to the block offset is in and only
+// the blocks the range covers are written, a block is read first only if
+// some of the file's bytes in it are kept. writing past the end grows the
+// file, anything between the old end and offset becomes zeros. like the
+// shell commands the changes reach the disk on the next commit.
+// returns length, -1 on error
+ssize_t FS::write(std::string filepath, size_t offset, size_t length, const uint8_t *buffer)
+{
+    path_handle file;
+    if (resolvePath(filepath, file) == -1)
+    {
+        return -1;
+    }
+    if (!file.found || file.entry.type == TYPE_DIR)
+    {
+        std::cout << "Error: " << file.name << " is not a file\n";
+        return -1;
+    }
+    if (!writePermitted(file.entry.access_rights))
+    {
+        std::cout << "Not allowed to write to this file\n";
+        return -1;
+    }
+    if (length == 0)
+    {
+        return 0;
+    }
+    size_t size = file.entry.size;
+    size_t end = offset + length;
+    if (end < offset || end > UINT32_MAX)
+    {
+        std::cout << "Error: File would be too big\n";
+        return -1;
+    }
+
+    // a write past the end also zeroes the gap, so what changes starts
+    // at the old end in that case
+    size_t from = std::min(offset, size);
+    uint16_t first_blk = file.entry.first_blk;
+    unsigned first = from / sb.block_size;
+    unsigned count = (end - 1) / sb.block_size - first + 1;
+    std::vector<unsigned> chain = chainRange(first_blk, first, count);
+    unsigned noOld = chain.size();
+    if (noOld < count)
+    {
+        // the chain ends inside the range, grow it right after its last
+        // block if that space is free
+        uint16_t tail = chain.empty() ? lastBlock(first_blk) : chain.back();
+        std::vector<unsigned> newBlocks = allocateBlocks(count - noOld, tail + 1);
+        if (newBlocks.empty())
+        {
+            std::cout << "Error: Disk is full\n";
+            return -1;
+        }
+        setFat(tail, newBlocks[0]);
+        chain.insert(chain.end(), newBlocks.begin(), newBlocks.end());
+        tailBlocks[first_blk] = chain.back();
+    }
+
+    std::vector<uint8_t> data(IO_BATCH * sb.block_size);
+    std::vector<unsigned> blocks;
+    std::vector<uint8_t *> blks;
+    for (unsigned start = 0; start < chain.size(); start += IO_BATCH)
+    {
+        unsigned n = std::min<unsigned>(IO_BATCH, chain.size() - start);
+        blocks.assign(chain.begin() + start, chain.begin() + start + n);
+        blks.clear();
+        for (unsigned j = 0; j < n; j++)
+        {
+            uint8_t *blk = data.data() + j * sb.block_size;
+            blks.push_back(blk);
+            size_t blkStart = (size_t)(first + start + j) * sb.block_size;
+            size_t blkEnd = blkStart + sb.block_size;
+            // read-modify-write only when the block keeps bytes of the file
+            // before or after the range, otherwise it is written over whole
+            if (start + j < noOld &&
+                (from > blkStart || end < std::min(size, blkEnd)))
+            {
+                if (cache.read(blocks[j], blk) == -1)
+                {
+                    return -1;
+                }
+            }
+            else
+            {
+                std::fill(blk, blk + sb.block_size, 0);
+            }
+            size_t lo = std::max(from, blkStart);
+            size_t hi = std::min(end, blkEnd);
+            if (lo < offset)
+            {
+                size_t gap = std::min(hi, offset);
+                std::fill(blk + (lo - blkStart), blk + (gap - blkStart), 0);
+                lo = gap;
+            }
+            if (lo < hi)
+            {
+                memcpy(blk + (lo - blkStart), buffer + (lo - offset), hi - lo);
+            }
+        }
+        cache.write_blocks(blocks, blks);
+    }
+
+    if (end > size)
+    {
+        patchEntry(file.dir.first_blk, file.name, end, first_blk);
+    }
+    return length;
+}
+
 // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
 // in the current directory
 int FS::mkdir(std::string dirpath)
 {
+    if (formatIfBlank() != 0)
+    {
+        return 1;
+    }
     treeNode *originNode = currentNode;
-    uint16_t origin = currentNode->entry->first_blk;
+    uint16_t origin = currentNode->entry.first_blk;
     std::string srcName = parseTilFile(dirpath);
     if (fileExist(srcName))
     {
@@ -1471,43 +2477,58 @@ int FS::mkdir(std::string dirpath)
         return 1;
     }
     std::cout << "FS::mkdir(" << dirpath << ")\n";
-    int freeIndex = getFreeIndex();
-    uint16_t parentBlock = currentNode->entry->first_blk;
-    uint8_t block[4096];
-    for (int i = 0; i < 4096; i++)
+    std::vector<unsigned> dirBlock = allocateBlocks(1);
+    if (dirBlock.empty())
+    {
+        std::cout << "Error: Disk is full\n";
+        changeWorkingDir(origin);
+        currentNode = originNode;
+        return 2;
+    }
+    uint16_t parentBlock = currentNode->entry.first_blk;
+    std::vector<uint8_t> block(sb.block_size);
+    for (int i = 0; i < (int)sb.block_size; i++)
     {
         block[i] = 0;
     }
-    disk.write(freeIndex, block);
-    fat[freeIndex] = FAT_EOF;
+    int freeIndex = dirBlock[0];
+    cache.write(freeIndex, block.data());
     std::cout << "Wrote directory to blk: " << freeIndex << std::endl;
     // create dir entry
-    dir_entry *newEntry = new dir_entry;
+    dir_entry newEntry = {};
     dirpath.push_back('\0');
     for (int i = 0; i < 56 && i < dirpath.size(); i++)
     {
-        newEntry->file_name[i] = srcName[i];
+        newEntry.file_name[i] = srcName[i];
     }
-    newEntry->first_blk = freeIndex;
-    newEntry->size = '-';
-    newEntry->access_rights = 0x07;
-    newEntry->type = 1;
-    workingDir.push_back(newEntry);
+    newEntry.first_blk = freeIndex;
+    newEntry.size = '-';
+    newEntry.access_rights = 0x07;
+    newEntry.type = 1;
+    unsigned slot = addWorkingDirEntry(newEntry);
     std::cout << "Added contents to dir: " << dirpath << std::endl;
 
+    // write current workingDir
+    if (writeWorkingDirToBlock(currentNode->entry.first_blk) == -1)
+    {
+        removeWorkingDirEntry(slot);
+        freeChain(freeIndex);
+        changeWorkingDir(origin);
+        currentNode = originNode;
+        return 2;
+    }
+
     // create new treeNode with the new directory
     treeNode *newBranch = new treeNode(currentNode, newEntry);
     currentNode->children.push_back(newBranch);
+    nodeIndex[freeIndex] = newBranch;
 
     // create DOTDOT entry for new directory.
-    dir_entry *dotDotDir = makeDotDotDir(parentBlock);
-
-    // write current workingDir
-    writeWorkingDirToBlock(currentNode->entry->first_blk);
+    dir_entry dotDotDir = makeDotDotDir(parentBlock);
 
     // change workingDir to newBranch and add the dotDotDir
     changeWorkingDir(freeIndex);
-    workingDir.push_back(dotDotDir);
+    addWorkingDirEntry(dotDotDir);
     writeWorkingDirToBlock(freeIndex);
     // change back to currentDir
     changeWorkingDir(origin);
@@ -1544,7 +2565,7 @@ int FS::pwd()
     std::vector<std::string> path;
     while (walker->parent != walker)
     {
-        path.push_back(walker->entry->file_name);
+        path.push_back(walker->entry.file_name);
         walker = walker->parent;
     }
     for (int i = path.size() - 1; i >= 0; i--)
@@ -1560,22 +2581,23 @@ int FS::pwd()
 int FS::setRecursiveRights(uint16_t workDir_blk, uint8_t rights)
 {
     changeWorkingDir(workDir_blk);
-    std::cout << currentNode->entry->file_name << std::endl;
+    std::cout << currentNode->entry.file_name << std::endl;
 
     // loop through all directories (except DOTDOT)
     // in the directory that had its chmod changed
     // and set all its subdirs DOTDOT to the same rights.
     for (int i = 0; i < workingDir.size(); i++) {
-        if(workingDir[i]->type == TYPE_DIR && workingDir[i]->file_name != DOTDOT){
-            uint16_t nextBlk = workingDir[i]->first_blk;
+        if(workingDir[i].type == TYPE_DIR && workingDir[i].file_name != DOTDOT){
+            uint16_t nextBlk = workingDir[i].first_blk;
             changeWorkingDir(nextBlk);
-            std::cout << currentNode->entry->file_name << std::endl;
+            std::cout << currentNode->entry.file_name << std::endl;
             int dotDotIndex = findIndexWorkingDir(DOTDOT);
-            workingDir[dotDotIndex]->access_rights = rights;
+            workingDir[dotDotIndex].access_rights = rights;
+            markWorkingDirEntry(dotDotIndex);
             writeWorkingDirToBlock(nextBlk);
             // change back to the dir we are working from.
             changeWorkingDir(workDir_blk);
-            std::cout << currentNode->entry->file_name << std::endl;
+            std::cout << currentNode->entry.file_name << std::endl;
         }
     }
 
@@ -1588,17 +2610,18 @@ int FS::chmod(std::string accessrights, std::string filepath)
 {
     treeNode *originNode = currentNode;
     std::cout << "FS::chmod(" << accessrights << "," << filepath << ")\n";
-    uint16_t origin = currentNode->entry->first_blk;
+    uint16_t origin = currentNode->entry.first_blk;
     uint8_t rights = std::stoi(accessrights);
 
     // special case if we get root as path
     if (filepath == "/"){
-        changeWorkingDir(ROOT_BLOCK);
-        root->entry->access_rights = rights;
+        changeWorkingDir(sb.root_blk);
+        root->entry.access_rights = rights;
         int dotDotIndex = findIndexWorkingDir(DOTDOT);
-        workingDir[dotDotIndex]->access_rights = rights;
-        writeWorkingDirToBlock(ROOT_BLOCK);
-        setRecursiveRights(ROOT_BLOCK, rights);
+        workingDir[dotDotIndex].access_rights = rights;
+        markWorkingDirEntry(dotDotIndex);
+        writeWorkingDirToBlock(sb.root_blk);
+        setRecursiveRights(sb.root_blk, rights);
 
         changeWorkingDir(origin);
         currentNode = originNode;
@@ -1609,9 +2632,10 @@ int FS::chmod(std::string accessrights, std::string filepath)
     int entryIndex = findIndexWorkingDir(srcName);
     if (entryIndex == -1) { std::cout << "File doesn't exist\n"; return 1;}
     // set access_rights
-    workingDir[entryIndex]->access_rights = rights;
-    writeWorkingDirToBlock(currentNode->entry->first_blk);
-    if (workingDir[entryIndex]->type == TYPE_FILE)
+    workingDir[entryIndex].access_rights = rights;
+    markWorkingDirEntry(entryIndex);
+    writeWorkingDirToBlock(currentNode->entry.first_blk);
+    if (workingDir[entryIndex].type == TYPE_FILE)
     {
         changeWorkingDir(origin);
         currentNode = originNode;
@@ -1620,27 +2644,258 @@ int FS::chmod(std::string accessrights, std::string filepath)
     // Make sure DOTDOT directory is mirrored
     // and the other way around so no discrepency exists
     // between the DOTDOT dir and the "real" dir it references.
-    if (workingDir[entryIndex]->file_name == DOTDOT &&
-        workingDir[entryIndex]->type == TYPE_DIR)
+    if (workingDir[entryIndex].file_name == DOTDOT &&
+        workingDir[entryIndex].type == TYPE_DIR)
     {
         // Find the dirs inside the dir with the
         // same block as the dotDotEntry and change
         // all their DOTDOT dirs aswell.
-        uint16_t dir_blk = workingDir[entryIndex]->first_blk;
-        changeWorkingDir(currentNode->parent->parent->entry->first_blk);
+        uint16_t dir_blk = workingDir[entryIndex].first_blk;
+        treeNode *dirNode = findNode(dir_blk);
+        changeWorkingDir(dirNode->parent->entry.first_blk);
         int realDirIndex = findIndexWorkingDirFromBlock(dir_blk);
-        workingDir[realDirIndex]->access_rights = rights;
-        writeWorkingDirToBlock(currentNode->entry->first_blk);
-        setRecursiveRights(workingDir[realDirIndex]->first_blk, rights);
+        workingDir[realDirIndex].access_rights = rights;
+        markWorkingDirEntry(realDirIndex);
+        writeWorkingDirToBlock(currentNode->entry.first_blk);
+        setRecursiveRights(workingDir[realDirIndex].first_blk, rights);
     }
     // If its not a special DOTDOT dir, we want to change the dirs subdirs DOTDOT
     // dir so that it has the same access_rights
-    else if (workingDir[entryIndex]->type == TYPE_DIR)
+    else if (workingDir[entryIndex].type == TYPE_DIR)
     {
-        setRecursiveRights(workingDir[entryIndex]->first_blk, rights);
+        setRecursiveRights(workingDir[entryIndex].first_blk, rights);
     }
 
     changeWorkingDir(origin);
     currentNode = originNode;
     return 0;
 }
+
+// collects the FAT chain of every file and directory on the disk, breadth
+// first from the root, which is always chains[0]. the indexes of the
+// chains that belong to directories are put in dirs. directory hash
+// index blocks are one block chains of their own
+void FS::collectChains(std::vector<std::vector<unsigned> > &chains, std::vector<unsigned> &dirs)
+{
+    chains.clear();
+    dirs.clear();
+    chains.push_back(getChain(sb.root_blk));
+    dirs.push_back(0);
+    if (sb.root_index != 0)
+    {
+        chains.push_back(std::vector<unsigned>(1, sb.root_index));
+    }
+    unsigned perBlock = sb.block_size / sizeof(disk_dir_entry);
+    for (unsigned d = 0; d < dirs.size(); d++)
+    {
+        // copy, chains grows while we go through the directory
+        std::vector<unsigned> dirChain = chains[dirs[d]];
+        for (unsigned k = 0; k < dirChain.size(); k++)
+        {
+            const disk_dir_entry *slots = (const disk_dir_entry *)cache.view(dirChain[k]);
+            for (unsigned i = 0; slots != nullptr && i < perBlock; i++)
+            {
+                if (slots[i].file_name[0] == '\0' || slotName(slots[i]) == DOTDOT)
+                {
+                    continue;
+                }
+                uint16_t first_blk = convert8to16(slots[i].first_blk[0], slots[i].first_blk[1]);
+                if (slots[i].type == TYPE_DIR)
+                {
+                    dirs.push_back(chains.size());
+                }
+                chains.push_back(getChain(first_blk));
+                uint32_t size = convert8to32(slots[i].size);
+                if (slots[i].type == TYPE_DIR && (size & DIR_INDEXED))
+                {
+                    chains.push_back(std::vector<unsigned>(1, size & 0xffff));
+                }
+            }
+        }
+    }
+}
+
+// prints how many files are split into more than one run of blocks
+// and how many runs the free space is spread over
+void FS::printFragmentation(const std::vector<std::vector<unsigned> > &chains)
+{
+    unsigned fragmented = 0;
+    unsigned extra = 0;
+    for (unsigned c = 0; c < chains.size(); c++)
+    {
+        unsigned pieces = chains[c].empty() ? 0 : 1;
+        for (unsigned k = 1; k < chains[c].size(); k++)
+        {
+            if (chains[c][k] != chains[c][k - 1] + 1)
+            {
+                pieces++;
+            }
+        }
+        if (pieces > 1)
+        {
+            fragmented++;
+            extra += pieces - 1;
+        }
+    }
+    std::cout << fragmented << " of " << chains.size() << " files/dirs fragmented ("
+              << extra << " extra fragments), free space in "
+              << findFreeRuns().size() << " runs\n";
+}
+
+// defrag moves the blocks of every file and directory so each of them
+// is one contiguous run, in breadth first order from the root, leaving
+// all the free space in one run at the end of the disk
+int FS::defrag()
+{
+    std::cout << "FS::defrag()\n";
+    if (sb.magic != FS_MAGIC)
+    {
+        std::cout << "No file system on disk, use format to create one\n";
+        return 1;
+    }
+    std::vector<std::vector<unsigned> > chains;
+    std::vector<unsigned> dirs;
+    collectChains(chains, dirs);
+    std::cout << "Before: ";
+    printFragmentation(chains);
+
+    // blocks in the order they should end up in, the first block of the
+    // root directory stays where it is
+    std::vector<unsigned> order;
+    for (unsigned c = 0; c < chains.size(); c++)
+    {
+        for (unsigned k = (c == 0 ? 1 : 0); k < chains[c].size(); k++)
+        {
+            order.push_back(chains[c][k]);
+        }
+    }
+    // at[p] is the original block now stored at p, -1 if p holds nothing,
+    // pos[b] is where the original block b is stored right now
+    std::vector<int> at(sb.no_blocks, -1);
+    std::vector<unsigned> pos(sb.no_blocks);
+    for (unsigned b = 0; b < sb.no_blocks; b++)
+    {
+        pos[b] = b;
+    }
+    for (unsigned i = 0; i < order.size(); i++)
+    {
+        at[order[i]] = order[i];
+    }
+
+    std::vector<uint8_t> block(sb.block_size);
+    std::vector<uint8_t> other(sb.block_size);
+    unsigned moved = 0;
+    unsigned dest = sb.root_blk + 1;
+    for (unsigned i = 0; i < order.size(); i++, dest++)
+    {
+        unsigned orig = order[i];
+        unsigned from = pos[orig];
+        if (from == dest)
+        {
+            continue;
+        }
+        cache.read(from, block.data());
+        if (at[dest] == -1)
+        {
+            // dest is free, just move the block there
+            at[from] = -1;
+        }
+        else
+        {
+            // dest holds a block that goes further out, swap them
+            cache.read(dest, other.data());
+            cache.write(from, other.data());
+            at[from] = at[dest];
+            pos[at[dest]] = from;
+        }
+        cache.write(dest, block.data());
+        at[dest] = orig;
+        pos[orig] = dest;
+        moved++;
+    }
+
+    // every chain is now one run, rebuild the FAT from scratch
+    std::vector<std::vector<unsigned> > newChains(chains.size());
+    std::vector<unsigned> newFirst(sb.no_blocks, 0);
+    newFirst[sb.root_blk] = sb.root_blk;
+    for (unsigned b = sb.root_blk + 1; b < sb.no_blocks; b++)
+    {
+        setFat(b, FAT_FREE);
+    }
+    dest = sb.root_blk + 1;
+    for (unsigned c = 0; c < chains.size(); c++)
+    {
+        for (unsigned k = 0; k < chains[c].size(); k++)
+        {
+            newChains[c].push_back(c == 0 && k == 0 ? sb.root_blk : dest++);
+            if (k > 0)
+            {
+                setFat(newChains[c][k - 1], newChains[c][k]);
+            }
+        }
+        if (!chains[c].empty())
+        {
+            newFirst[chains[c][0]] = newChains[c][0];
+            setFat(newChains[c].back(), FAT_EOF);
+        }
+    }
+
+    // point every directory entry, ".." ones included, at the new blocks
+    unsigned perBlock = sb.block_size / sizeof(disk_dir_entry);
+    for (unsigned d = 0; d < dirs.size(); d++)
+    {
+        const std::vector<unsigned> &dirChain = newChains[dirs[d]];
+        for (unsigned k = 0; k < dirChain.size(); k++)
+        {
+            disk_dir_entry *slots = (disk_dir_entry *)cache.modify(dirChain[k]);
+            for (unsigned i = 0; slots != nullptr && i < perBlock; i++)
+            {
+                if (slots[i].file_name[0] == '\0')
+                {
+                    continue;
+                }
+                uint16_t first_blk = convert8to16(slots[i].first_blk[0], slots[i].first_blk[1]);
+                convert16to8(newFirst[first_blk], slots[i].first_blk);
+                uint32_t size = convert8to32(slots[i].size);
+                if (slots[i].type == TYPE_DIR && (size & DIR_INDEXED))
+                {
+                    convert32to8(DIR_INDEXED | newFirst[size & 0xffff], slots[i].size);
+                }
+            }
+        }
+    }
+    if (sb.root_index != 0)
+    {
+        sb.root_index = newFirst[sb.root_index];
+        root->entry.size = DIR_INDEXED | sb.root_index;
+        writeSuperBlock();
+    }
+    // and the copies of the entries in the directory tree
+    std::vector<treeNode *> nodes;
+    nodes.push_back(root);
+    nodeIndex.clear();
+    for (unsigned n = 0; n < nodes.size(); n++)
+    {
+        nodeIndex[nodes[n]->entry.first_blk] = nodes[n];
+        for (unsigned c = 0; c < nodes[n]->children.size(); c++)
+        {
+            treeNode *child = nodes[n]->children[c];
+            child->entry.first_blk = newFirst[child->entry.first_blk];
+            if (child->entry.size & DIR_INDEXED)
+            {
+                child->entry.size = DIR_INDEXED | newFirst[child->entry.size & 0xffff];
+            }
+            nodes.push_back(child);
+        }
+    }
+    // the parsed directories and the file tails still have the old block numbers
+    tailBlocks.clear();
+    clearDcache();
+    deleteWorkingDir();
+    changeWorkingDir(currentNode->entry.first_blk);
+
+    std::cout << "Moved " << moved << " blocks\n";
+    std::cout << "After: ";
+    printFragmentation(newChains);
+    return 0;
+}
@@ -1,22 +1,43 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstddef>
 #include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <sys/types.h>
 #include "disk.h"
+#include "cache.h"
 
 #ifndef __FS_H__
 #define __FS_H__
 
-#define ROOT_BLOCK 0
+// the superblock is always block 0, the FAT starts right after it
+// and the root directory comes after the FAT
+#define SUPER_BLOCK 0
 #define FAT_BLOCK 1
 #define FAT_FREE 0
 #define FAT_EOF -1
+// FAT entries are 32 bit, but dir_entry::first_blk is 16 bit
+// so a disk can have this many blocks at most
+#define MAX_NO_BLOCKS 65535
+// "FSB3", marks a disk formatted with a superblock and a 32 bit FAT whose
+// file sizes are exact. "FSB2" disks count a terminator in the size and
+// are treated as unformatted
+#define FS_MAGIC 0x46534233
 
 #define TYPE_FILE 0
 #define TYPE_DIR 1
 #define READ 0x04
 #define WRITE 0x02
 #define EXECUTE 0x01
+// how many blocks of a file are read/written per vectored disk call
+#define IO_BATCH 16
+// a directory that spans more than one block gets a hash index block.
+// its dir_entry::size is then DIR_INDEXED | the index block, otherwise '-'
+#define DIR_INDEXED 0x80000000
+// how many parsed directories besides the working dir are kept in memory
+#define DCACHE_DIRS 16
 
 
 // TODO
@@ -38,74 +59,217 @@ struct dir_entry {
     uint8_t access_rights = 0; // read (0x04), write (0x02), execute (0x01)
 };
 
+// the on-disk form of a dir_entry, the numbers are stored big endian
+// whatever the host is. a directory block is an array of these and is
+// looked at in place, so the layout must not have any padding
+struct disk_dir_entry {
+    char file_name[56];
+    uint8_t size[4];
+    uint8_t first_blk[2];
+    uint8_t type;
+    uint8_t access_rights;
+};
+static_assert(sizeof(disk_dir_entry) == 64, "a dir_entry takes up 64 bytes on disk");
+static_assert(alignof(disk_dir_entry) == 1, "directory blocks are viewed at any 64 byte offset");
+static_assert(offsetof(disk_dir_entry, size) == 56, "size follows the 56 byte name");
+static_assert(offsetof(disk_dir_entry, first_blk) == 60, "first_blk is at byte 60");
+static_assert(offsetof(disk_dir_entry, type) == 62, "type is at byte 62");
+static_assert(offsetof(disk_dir_entry, access_rights) == 63, "access_rights is at byte 63");
+
+struct super_block {
+    uint32_t magic = 0; // FS_MAGIC on a formatted disk
+    uint32_t block_size = 0; // size of a block in bytes
+    uint32_t no_blocks = 0; // number of blocks on the disk
+    uint32_t fat_blocks = 0; // number of blocks the FAT takes up
+    uint32_t root_blk = 0; // first block of the root directory
+    uint32_t root_index = 0; // hash index block of the root directory, 0 if none
+};
+
 struct treeNode
 {
     treeNode* parent;
-    dir_entry* entry;
+    // a copy of the directory's entry in its parent, held by value so
+    // growing the tree doesn't allocate an entry per node
+    dir_entry entry;
     std::vector<treeNode*> children;
-    treeNode()
-    {
-        parent = nullptr;
-        entry = nullptr;
-    }
-    treeNode(treeNode *parent)
-    {
-        this->parent = parent;
-        entry = nullptr;
-    }
-    treeNode(treeNode *parent, dir_entry *entry)
-    {
-        this->parent = parent;
-        // copy over the dir entry
-        dir_entry *newEntry = new dir_entry;
-        for (int i = 0; i < 56; i++)
-        {
-            newEntry->file_name[i] = entry->file_name[i];
-        }
-        newEntry->first_blk = entry->first_blk;
-        newEntry->size = entry->size;
-        newEntry->access_rights = entry->access_rights;
-        newEntry->type = entry->type;
-
-        this->entry = newEntry;
-    }
+    // children are made as the tree is walked, this is set once all
+    // the sub-directories of this one are in children
+    bool expanded = false;
+    treeNode(treeNode *parent, const dir_entry &entry) : parent(parent), entry(entry) {}
 };
 
 class FS {
 private:
     Disk disk;
-    // size of a FAT entry is 2 bytes
-    int16_t fat[BLOCK_SIZE/2];
-    // size of a dir_entry is 64 bytes
-    std::vector<dir_entry*> workingDir;
+    // every block access from the FS goes through the cache
+    BlockCache cache;
+    // geometry of the mounted disk, read from block 0
+    super_block sb;
+    // size of a FAT entry is 4 bytes, one entry per block on the disk
+    std::vector<int32_t> fat;
+    // one flag per FAT block, set when an entry in that block has changed
+    std::vector<bool> fatDirty;
+    // one bit per block, set while the block is free. kept in step
+    // with the FAT by setFat and rebuilt from the FAT at mount
+    std::vector<uint64_t> freeMap;
+    // word in freeMap where the next search for a free block starts
+    unsigned freeHint = 0;
+    // number of free blocks
+    unsigned noFree = 0;
+    void buildFreeMap();
+    // a run of contiguous blocks
+    struct extent {
+        unsigned start;
+        unsigned length;
+    };
+    // returns every run of contiguous free blocks, in block order
+    std::vector<extent> findFreeRuns();
+    // reserves count free blocks and links them into a chain ending in EOF.
+    // goal is used if the run starting there is free. otherwise one block
+    // comes straight from the free map, more from the smallest run that
+    // fits, otherwise as few runs as possible.
+    // returns an empty vector if there is not enough free space
+    std::vector<unsigned> allocateBlocks(unsigned count, int goal = -1);
+    // collects the FAT chain of every file and directory, root first,
+    // and which of the chains belong to directories
+    void collectChains(std::vector<std::vector<unsigned> > &chains, std::vector<unsigned> &dirs);
+    // prints how fragmented the given chains and the free space are
+    void printFragmentation(const std::vector<std::vector<unsigned> > &chains);
+    // sets a FAT entry and marks its FAT block as changed
+    void setFat(unsigned index, int32_t value);
+    // size of a dir_entry is 64 bytes. entries are held by value, the
+    // vector's storage comes from the dcache's pool of cached_dirs.
+    // workingDir[i] is slot i of the directory on disk, a removed entry
+    // leaves an empty slot (a tombstone) so the ones after it stay put
+    std::vector<dir_entry> workingDir;
+    // name -> index in workingDir, built when a directory is read in and
+    // kept up to date by addWorkingDirEntry/removeWorkingDirEntry
+    std::unordered_map<std::string, unsigned> workingDirIndex;
+    // the empty slots in workingDir, reused before the directory grows
+    std::vector<unsigned> workingDirFree;
+    // slots changed since workingDir was last written, only these are
+    // written by writeWorkingDirToBlock
+    std::vector<unsigned> workingDirDirty;
+    // all changes to workingDir go through these so the index stays right.
+    // add returns the slot the entry went in
+    unsigned addWorkingDirEntry(const dir_entry &entry);
+    dir_entry removeWorkingDirEntry(unsigned index);
+    // for when fields of workingDir[index] other than the name are changed
+    void markWorkingDirEntry(unsigned index);
+    static bool emptySlot(const dir_entry &entry) { return entry.file_name[0] == '\0'; }
+    static std::string entryName(const dir_entry &entry);
+    // first block of the directory in workingDir, 0 if nothing is loaded
+    uint16_t workingDirBlk = 0;
+    // directories parsed earlier, most recently used first. switching the
+    // working dir moves the old one in here and takes the new one out if
+    // it is here, so going back to a directory doesn't read or allocate
+    struct cached_dir {
+        uint16_t blk;
+        std::vector<dir_entry> entries;
+        std::unordered_map<std::string, unsigned> index;
+        std::vector<unsigned> free;
+    };
+    std::list<cached_dir> dcache;
+    // evicted cached_dirs, kept with their storage so the next directory
+    // read in reuses it instead of allocating
+    std::list<cached_dir> dcacheFree;
+    // a cached_dir for blk at the front of the dcache, taken from
+    // dcacheFree if there is one
+    cached_dir &newCachedDir(uint16_t blk);
+    std::unordered_map<uint16_t, std::list<cached_dir>::iterator> dcacheIndex;
+    // moves workingDir into the dcache, evicting the oldest if it is full
+    void stashWorkingDir();
+    // forgets the parsed directory at blk, for when its blocks change
+    // behind workingDir's back
+    void dropCachedDir(uint16_t blk);
+    void clearDcache();
     treeNode *root = nullptr;
     treeNode *currentNode = nullptr;
     void cleanUp();
     void cleanUpDirs(treeNode* branch);
-    void cleanUpFiles();
     void deleteWorkingDir();
+    // writes the FAT blocks that have changed, only done at commit points
     void updateFat();
-    void readInFatRoot();
+    void readInFat();
+    // reads the superblock and sets up the disk geometry from it,
+    // returns -1 if the disk has no valid superblock
+    int readSuperBlock();
+    void writeSuperBlock();
+    // formats the disk with its current geometry if it has no file system
+    // yet, done before the first change to an unformatted disk
+    int formatIfBlank();
+    // fills in sb and sizes the FAT for the given geometry
+    void setupGeometry(unsigned no_blocks, unsigned block_size);
+    // reads every block of the directory starting at blk into entries
+    void readDir(uint16_t blk, std::vector<dir_entry> &entries,
+                 std::unordered_map<std::string, unsigned> &index,
+                 std::vector<unsigned> &free);
+    // the parsed entries of the directory at blk, reading it into the
+    // dcache if it isn't the working dir or cached already
+    const std::vector<dir_entry> &parsedDir(uint16_t blk);
+    // reads the directory starting at blk into workingDir
     void initWorkingDir(uint16_t blk);
     void changeWorkingDir(uint16_t blk);
+    // only sets up the root, the rest of the tree is built as it is walked
     void initTree();
-    void initTreeContinued(treeNode *branch);
-    void writeWorkingDirToBlock(uint16_t blk);
-    dir_entry* copyDirEntry(dir_entry* dir);
-    dir_entry* copyDirEntry(dir_entry* dir, std::string name);
-    dir_entry* copyDirEntry(dir_entry* dir, std::string name, uint16_t first_blk);
-    dir_entry* makeDotDotDir(uint16_t blk);
+    // adds the nodes of all sub-directories of node to the tree
+    void expandNode(treeNode *node);
+    // the node of the sub-directory entry of node, made if not there yet
+    treeNode* childNode(treeNode *node, const dir_entry &entry);
+    // writes workingDir back over the directory's FAT chain, growing or
+    // shrinking it as needed. returns -1 if the disk is too full to grow
+    int writeWorkingDirToBlock(uint16_t blk);
+    // unpacks / packs the 64 byte on-disk form of a dir_entry
+    dir_entry readDirEntry(const disk_dir_entry &slot);
+    void writeDirEntry(const dir_entry &dir, disk_dir_entry &slot);
+    // the name in a slot, which is only null terminated if shorter than 56
+    static std::string slotName(const disk_dir_entry &slot);
+    // the hash index of a directory is one block with a bit per (bucket,
+    // leaf block) pair, set if a name in that bucket is in that leaf
+    static uint32_t nameHash(const std::string &name);
+    void buildDirIndex(unsigned noLeaves, std::vector<uint8_t> &block);
+    // records the index block of a directory in its dir_entry, both in the
+    // tree and on disk in the parent directory (the superblock for root)
+    void setDirIndex(treeNode *node, uint16_t index_blk);
+    // sets size and first_blk of the entry called name in the directory at
+    // dir_blk, in its parsed copy and on disk
+    void patchEntry(uint16_t dir_blk, const std::string &name, uint32_t size, uint16_t first_blk);
+    // looks up name in the directory dir without reading all of it in, only
+    // the index block and the leaf blocks it points at are read.
+    // returns -1 if the name is not there
+    int lookupEntry(const dir_entry &dir, const std::string &name, dir_entry &result);
+    // marks every block in the FAT chain starting at first_blk as free
+    void freeChain(uint16_t first_blk);
+    dir_entry makeDotDotDir(uint16_t blk);
 
     // recursively goes through a workingDir changing
     // all its directories dotdot entries access_rights
     int setRecursiveRights(uint16_t workDir_blk, uint8_t rights);
-    // help function for searching tree.
-    treeNode* BFS(uint16_t blk);
+    // first block of a directory -> its node, for every node in the tree
+    std::unordered_map<uint16_t, treeNode*> nodeIndex;
+    // the node of the directory starting at blk, nullptr if not in the tree
+    treeNode* findNode(uint16_t blk);
+    // moves the node of a directory that was mv'ed to its new parent
+    void moveNode(const dir_entry &entry, treeNode *newParent);
 
-    // parses a filepath and calls changeDirectory()
-    // to change current workingDir to last directory in path
-    // if it exists. if doesnt exist it returns -1
+    // where a path leads: the directory its last name is in and, if
+    // there is one, the entry with that name
+    struct path_handle {
+        treeNode *node;
+        dir_entry dir;
+        std::string name;
+        bool found;
+        dir_entry entry;
+    };
+    // resolves path without changing currentNode or workingDir, returns
+    // -1 if a directory on the way doesn't exist or can't be entered
+    int resolvePath(const std::string &path, path_handle &handle);
+    // makes the directory the handle's name is in the working dir
+    void enterDir(const path_handle &handle);
+    // parses a filepath and changes current workingDir to the
+    // last directory in path if it exists. if doesnt exist it returns -1
     int parsePath(std::string path);
+    // same as resolvePath followed by enterDir, returns the last name
     std::string parseTilFile(std::string path);
     // checks if file exists and is a directory, then changes directory
     // return -1 if it doesnt exists or is a file.
@@ -116,13 +280,32 @@ private:
     uint16_t convert8to16(uint8_t num1, uint8_t num2);
     void convert16to8(uint16_t num, uint8_t * result);
     int getSecondNum(uint16_t num);
-    uint32_t convert8to32(uint8_t *result);
+    uint32_t convert8to32(const uint8_t *result);
     void convert32to8(uint32_t num, uint8_t *result);
-    // help function for cp return first block index
+    // returns the block numbers of a file's FAT chain, in order
+    std::vector<unsigned> getChain(uint16_t first_blk);
+    // blocks start to start + count - 1 of a file's FAT chain
+    std::vector<unsigned> chainRange(uint16_t first_blk, unsigned start, unsigned count);
+    // reads count blocks of chain, starting at chain[start], into buffer
+    // (count * BLOCK_SIZE bytes) with one vectored disk read
+    int readChainBlocks(const std::vector<unsigned> &chain, unsigned start,
+                        unsigned count, uint8_t *buffer);
+    // writes length bytes to standard output with as few write calls as
+    // it takes, after what std::cout has buffered. -1 on error
+    int writeStdout(const uint8_t *data, size_t length);
+    // help function for create return first block index
     int writeBlocksFromString(std::string contents);
-    //Writes to already existing block from string
-    int writeBlocksFromString
-        (std::string filepath, std::string contents, uint16_t startFatIndex, int blockIndex);
+    // copies a file's blocks to a new chain for cp, returns its first block
+    int copyChain(uint16_t first_blk);
+    // appends length bytes of the file starting at src_blk to the file whose
+    // last block is tail, which already holds offset bytes of it.
+    // returns the new last block, -1 if the disk is too full
+    int appendChain(uint16_t src_blk, size_t length, uint16_t tail, unsigned offset);
+    // first block of a file -> its last block, kept for the files that
+    // have been appended to so the next append doesn't walk the FAT
+    std::unordered_map<uint16_t, uint16_t> tailBlocks;
+    // the last block of the file starting at first_blk
+    uint16_t lastBlock(uint16_t first_blk);
     // return index of first block, -1 if not found
     int findBlockWorkingDir(std::string filename);
     // returns index in workingDir array, -1 if not found
@@ -131,8 +314,6 @@ private:
     int findIndexWorkingDirFromBlock(uint16_t blk);
     // check if file exists
     bool fileExist(std::string filename);
-    // Finds end of file both block index and end in said block
-    void findEOF(uint16_t first_blk, uint16_t *result);
     //Checks if dir is empty
     bool dirEmpty(uint16_t blk);
     //Choose rights out of param-string
@@ -150,7 +331,16 @@ public:
     FS();
     ~FS();
     // formats the disk, i.e., creates an empty file system
+    // with the same geometry as before
     int format();
+    // format <no_blocks> <block_size> formats the disk with a new geometry
+    int format(unsigned no_blocks, unsigned block_size);
+    // commit writes the changed parts of the FAT and every modified block
+    // in the cache back to the disk. the FAT is only persisted here, it is
+    // called at the end of each command that changes the file system
+    int commit();
+    // sync commits and then flushes the disk file itself
+    int sync();
     // create <filepath> creates a new file on the disk, the data content is
     // written on the following rows (ended with an empty row)
     int create(std::string filepath);
@@ -174,6 +364,14 @@ public:
     // append <filepath1> <filepath2> appends the contents of file <filepath1> to
     // the end of file <filepath2>. The file <filepath1> is unchanged.
     int append(std::string filepath1, std::string filepath2);
+    // read copies up to length bytes of the file <filepath> from byte
+    // offset on into buffer, only reading the blocks that range is in.
+    // returns the number of bytes read, fewer at the end of the file, -1 on error
+    ssize_t read(std::string filepath, size_t offset, size_t length, uint8_t *buffer);
+    // write writes length bytes from buffer into the file <filepath> at
+    // byte offset, growing it if the range goes past the end. only the
+    // blocks in the range are written. returns length, -1 on error
+    ssize_t write(std::string filepath, size_t offset, size_t length, const uint8_t *buffer);
 
     // mkdir <dirpath> creates a new sub-directory with the name <dirpath>
     // in the current directory
@@ -187,6 +385,10 @@ public:
     // chmod <accessrights> <filepath> changes the access rights for the
     // file <filepath> to <accessrights>.
     int chmod(std::string accessrights, std::string filepath);
+
+    // defrag moves every file and directory into one contiguous run of
+    // blocks and all free space to the end of the disk
+    int defrag();
 };
 
 #endif // __FS_H__
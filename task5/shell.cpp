@@ -9,7 +9,7 @@ std::string commands_str[] = {
     "format", "create", "cat", "ls",
     "cp", "mv", "rm", "append",
     "mkdir", "cd", "pwd",
-    "chmod",
+    "chmod", "sync", "defrag",
     "help", "quit"
 };
 
@@ -66,12 +66,21 @@ Shell::run()
         }
 
         if (cmd == "format") {
-            if (cmd_line.size() != 1) {
-                std::cout << "Usage: format\n";
+            if (cmd_line.size() != 1 && cmd_line.size() != 3) {
+                std::cout << "Usage: format [<no_blocks> <block_size>]\n";
                 continue;
             }
             // check return value so everything is ok
-            ret_val = filesystem.format();
+            if (cmd_line.size() == 3) {
+                try {
+                    ret_val = filesystem.format(std::stoul(cmd_line[1]), std::stoul(cmd_line[2]));
+                } catch (std::exception &e) {
+                    std::cout << "Usage: format [<no_blocks> <block_size>]\n";
+                    continue;
+                }
+            } else {
+                ret_val = filesystem.format();
+            }
             if (ret_val) {
                 std::cout << "Error: format failed, error code " << ret_val << std::endl;
             }
@@ -236,12 +245,36 @@ Shell::run()
             }
         }
 
+        else if (cmd == "sync") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: sync\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.sync();
+            if (ret_val) {
+                std::cout << "Error: sync failed, error code " << ret_val << std::endl;
+            }
+        }
+
+        else if (cmd == "defrag") {
+            if (cmd_line.size() != 1) {
+                std::cout << "Usage: defrag\n";
+                continue;
+            }
+            // check return value so everything is ok
+            ret_val = filesystem.defrag();
+            if (ret_val) {
+                std::cout << "Error: defrag failed, error code " << ret_val << std::endl;
+            }
+        }
+
         else if (cmd == "quit")
             running = false;
 
         else if (cmd == "help") {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, defrag, help, quit\n";
         }
 
         else if (cmd == "") {
@@ -250,7 +283,14 @@ Shell::run()
 
         else {
             std::cout << "Available commands:\n";
-            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, help, quit\n";
+            std::cout << "format, create, cat, ls, cp, mv, rm, append, mkdir, cd, pwd, chmod, sync, defrag, help, quit\n";
+        }
+
+        // commit point, write back the blocks a modifying command changed
+        if (cmd == "format" || cmd == "create" || cmd == "cp" || cmd == "mv" ||
+            cmd == "rm" || cmd == "append" || cmd == "mkdir" || cmd == "chmod" ||
+            cmd == "defrag") {
+            filesystem.commit();
         }
     }
 }